@@ -0,0 +1,57 @@
+/*                       _        _       __                _
+ *   _ __ ___   ___   __| |    __| | ___ / _| ___ _ __   __| | ___ _ __
+ *  | '_ ` _ \ / _ \ / _` |   / _` |/ _ \ |_ / _ \ '_ \ / _` |/ _ \ '__|
+ *  | | | | | | (_) | (_| |  | (_| |  __/  _|  __/ | | | (_| |  __/ |
+ *  |_| |_| |_|\___/ \__,_|___\__,_|\___|_|  \___|_| |_|\__,_|\___|_|
+ *                       |_____|
+ *  Copyright (c) 2017 Annihil
+ *  Released under the GPLv3
+ */
+
+#ifndef MOD_DEFENDER_URLDECODE_HPP
+#define MOD_DEFENDER_URLDECODE_HPP
+
+#include <cstring>
+
+static inline int url_decode_hex(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/*
+ * Decodes a NUL terminated string in place, the result is byte for byte the
+ * one of ap_unescape_url(): %XX escapes are decoded (%00 and %2F included)
+ * and malformed escapes are left as they are.
+ * Rather than walking every byte, the runs between two '%' are found with
+ * strcspn() and moved with memmove(), which the C library dispatches at
+ * runtime to its SSE4.2 / AVX2 implementations when the CPU has them.
+ */
+static inline void url_decode(char *str) {
+    char *x = strchr(str, '%');
+    if (x == NULL)
+        return;
+    char *y = x;
+    while (*y) {
+        // *y is a '%' here
+        int hi = url_decode_hex(y[1]);
+        int lo = hi < 0 ? -1 : url_decode_hex(y[2]);
+        if (lo >= 0) {
+            *x++ = (char) ((hi << 4) | lo);
+            y += 3;
+        } else {
+            *x++ = *y++;
+        }
+        size_t run = strcspn(y, "%");
+        memmove(x, y, run);
+        x += run;
+        y += run;
+    }
+    *x = '\0';
+}
+
+#endif // MOD_DEFENDER_URLDECODE_HPP
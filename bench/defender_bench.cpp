@@ -0,0 +1,565 @@
+/*
+ *  defender_bench - replays recorded HTTP requests through RuntimeScanner
+ *  without Apache, to measure a rule set and compare its verdicts.
+ *
+ *  Copyright (c) 2017 Annihil
+ *  Released under the GPLv3
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#include "libdefiance/RuntimeScanner.hpp"
+#include "UrlDecode.hpp"
+
+/*
+ * Allocation accounting: every operator new of a replay thread is counted
+ */
+static thread_local unsigned long thread_allocs;
+
+void *operator new(size_t size) {
+    thread_allocs++;
+    void *p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void *p) noexcept {
+    free(p);
+}
+
+/*
+ * Hardware counters of a replay thread, from Linux perf events in user space
+ * only. They stay unavailable where perf_event_paranoid or a container forbid
+ * them.
+ */
+enum {
+    COUNTER_INSTRUCTIONS,
+    COUNTER_CYCLES,
+    COUNTER_BRANCHES,
+    COUNTER_BRANCH_MISSES,
+    COUNTER_COUNT
+};
+
+typedef struct {
+    int fds[COUNTER_COUNT];
+    unsigned long long values[COUNTER_COUNT];
+} thread_counters_t;
+
+static void counters_start(thread_counters_t *counters) {
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        counters->fds[i] = -1;
+        counters->values[i] = 0;
+    }
+#ifdef __linux__
+    static const unsigned long long configs[COUNTER_COUNT] = {PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CPU_CYCLES,
+                                                              PERF_COUNT_HW_BRANCH_INSTRUCTIONS,
+                                                              PERF_COUNT_HW_BRANCH_MISSES};
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[i];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        if (counters->fds[i] >= 0)
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+#endif
+}
+
+/* Leaves out of the counts what the thread runs until they are resumed */
+static void counters_pause(thread_counters_t *counters, bool pause) {
+#ifdef __linux__
+    for (int i = 0; i < COUNTER_COUNT; i++)
+        if (counters->fds[i] >= 0)
+            ioctl(counters->fds[i], pause ? PERF_EVENT_IOC_DISABLE : PERF_EVENT_IOC_ENABLE, 0);
+#else
+    (void) counters;
+    (void) pause;
+#endif
+}
+
+/* False if a counter could not be read */
+static bool counters_stop(thread_counters_t *counters) {
+    bool available = true;
+    for (int i = 0; i < COUNTER_COUNT; i++) {
+        int fd = counters->fds[i];
+        if (fd < 0) {
+            available = false;
+            continue;
+        }
+#ifdef __linux__
+        ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+#endif
+        if (read(fd, &counters->values[i], sizeof(counters->values[i])) != sizeof(counters->values[i]))
+            available = false;
+        close(fd);
+    }
+    return available;
+}
+
+typedef struct {
+    std::string method;
+    std::string uri;
+    std::string protocol;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+} recorded_request_t;
+
+typedef struct {
+    const char *corpusPath = NULL;
+    const char *baselinePath = NULL;
+    const char *verdictsPath = NULL;
+    const char *matchlogPath = NULL;
+    unsigned int threads = 1;
+    unsigned int passes = 1;
+    unsigned long bodyLimit = 8388608;
+    bool learning = false;
+    bool extensive = false;
+    bool libinjSQL = false;
+    bool libinjXSS = false;
+} bench_config_t;
+
+static FILE *matchlog_file;
+
+static int write_log(void *thefile, const void *buf, size_t *nbytes) {
+    if (thefile != NULL)
+        fwrite(buf, 1, *nbytes, (FILE *) thefile);
+    return 0;
+}
+
+static std::string trim(const std::string &str) {
+    size_t first = str.find_first_not_of(" \t\r\n");
+    if (first == std::string::npos)
+        return "";
+    size_t last = str.find_last_not_of(" \t\r\n");
+    return str.substr(first, last - first + 1);
+}
+
+/* Next word of a directive line, quotes handled the way ap_getword_conf() does */
+static std::string next_word(const std::string &line, size_t &pos) {
+    while (pos < line.size() && isspace((unsigned char) line[pos]))
+        pos++;
+    if (pos >= line.size())
+        return "";
+    std::string word;
+    char quote = line[pos];
+    if (quote == '"' || quote == '\'') {
+        pos++;
+        while (pos < line.size() && line[pos] != quote) {
+            if (line[pos] == '\\' && pos + 1 < line.size() && line[pos + 1] == quote)
+                pos++;
+            word += line[pos++];
+        }
+        pos++;
+    } else {
+        while (pos < line.size() && !isspace((unsigned char) line[pos]))
+            word += line[pos++];
+    }
+    return word;
+}
+
+/*
+ * Loads MainRule, CheckRule and BasicRule directives, any other line
+ * (comments, Apache directives) is ignored.
+ */
+static bool load_rules(const char *path, std::vector<std::pair<std::string, std::string>> &checkRules,
+                       std::vector<std::string> &basicRules) {
+    std::ifstream in(path);
+    if (!in) {
+        fprintf(stderr, "cannot open rules file %s\n", path);
+        return false;
+    }
+    std::string line, pending;
+    while (std::getline(in, line)) {
+        line = trim(line);
+        // Apache line continuation
+        if (!line.empty() && line.back() == '\\') {
+            line.pop_back();
+            pending += line;
+            continue;
+        }
+        line = pending + line;
+        pending.clear();
+
+        size_t pos = 0;
+        std::string directive = next_word(line, pos);
+        std::string args = trim(line.substr(pos));
+        if (directive == "MainRule") {
+            tmpMainRules.push_back(args);
+        } else if (directive == "BasicRule") {
+            basicRules.push_back(args);
+        } else if (directive == "CheckRule") {
+            pos = 0;
+            std::string score = next_word(args, pos);
+            std::string action = next_word(args, pos);
+            checkRules.push_back(std::make_pair(score, action));
+        }
+    }
+    return true;
+}
+
+/*
+ * Corpus format: raw HTTP/1.x requests one after the other, each body
+ * being exactly Content-Length bytes long.
+ */
+static bool load_corpus(const char *path, std::vector<recorded_request_t> &corpus) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        fprintf(stderr, "cannot open corpus %s\n", path);
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        line = trim(line);
+        if (line.empty())
+            continue;
+        recorded_request_t req;
+        size_t pos = 0;
+        req.method = next_word(line, pos);
+        req.uri = next_word(line, pos);
+        req.protocol = next_word(line, pos);
+        if (req.protocol.empty())
+            req.protocol = "HTTP/1.1";
+
+        unsigned long contentLength = 0;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (line.empty())
+                break;
+            size_t colon = line.find(':');
+            if (colon == std::string::npos)
+                continue;
+            std::string key = trim(line.substr(0, colon));
+            std::string val = trim(line.substr(colon + 1));
+            if (strcasecmp(key.c_str(), "Content-Length") == 0)
+                contentLength = strtoul(val.c_str(), NULL, 10);
+            req.headers.push_back(std::make_pair(key, val));
+        }
+        if (contentLength > 0) {
+            req.body.resize(contentLength);
+            in.read(&req.body[0], contentLength);
+            req.body.resize((size_t) in.gcount());
+        }
+        corpus.push_back(std::move(req));
+    }
+    return true;
+}
+
+typedef struct {
+    int ret;
+    bool block;
+    bool drop;
+    decltype(RuntimeScanner::matchScores) scores;
+} replay_result_t;
+
+/*
+ * Runs one request through the scanner the way header_parser() then
+ * fixups() do, and returns what it decided.
+ */
+static replay_result_t replay(RuleParser &parser, const bench_config_t &cfg, const recorded_request_t &req, size_t id) {
+    RuntimeScanner scanner(parser);
+
+    if (req.method == "GET")
+        scanner.method = METHOD_GET;
+    else if (req.method == "POST")
+        scanner.method = METHOD_POST;
+    else if (req.method == "PUT")
+        scanner.method = METHOD_PUT;
+
+    scanner.pid = getpid();
+    scanner.threadId = "bench";
+    scanner.connectionId = (long) id;
+    scanner.clientIp = "127.0.0.1";
+    scanner.serverHostname = "localhost";
+    scanner.fullUri = req.uri;
+    scanner.protocol = req.protocol;
+    scanner.softwareVersion = "bench";
+    scanner.logLevel = static_cast<LOG_LVL>(0);
+    scanner.writeLogFn = write_log;
+    scanner.errorLogFile = NULL;
+    scanner.learningLogFile = reinterpret_cast<decltype(scanner.learningLogFile)>(matchlog_file);
+    scanner.learningJSONLogFile = NULL;
+    scanner.learning = cfg.learning;
+    scanner.extensiveLearning = cfg.extensive;
+    scanner.libinjSQL = cfg.libinjSQL;
+    scanner.libinjXSS = cfg.libinjXSS;
+    scanner.bodyLimit = cfg.bodyLimit;
+
+    size_t query = req.uri.find('?');
+    std::string path = req.uri.substr(0, query);
+    scanner.setUri(&path[0]);
+
+    for (const auto &header : req.headers) {
+        std::string key = header.first, val = header.second;
+        if (strcasecmp(key.c_str(), "Host") == 0)
+            scanner.requestedHost = val;
+        scanner.addHeader(&key[0], &val[0]);
+    }
+
+    if (query != std::string::npos) {
+        std::string args = req.uri.substr(query + 1);
+        char *state;
+        for (char *key = strtok_r(&args[0], "&", &state); key != NULL; key = strtok_r(NULL, "&", &state)) {
+            char one[] = "1";
+            char *val = strchr(key, '=');
+            if (val != NULL) {
+                *val++ = '\0';
+                url_decode(val);
+            } else {
+                val = one;
+            }
+            url_decode(key);
+            scanner.addGETParameter(key, val);
+        }
+    }
+
+    int ret = scanner.processHeaders();
+
+    // Apache only goes on to fixups() when header_parser() returned OK (0) or DECLINED (-1)
+    bool headersPassed = ret == 0 || ret == -1;
+    if (headersPassed && (scanner.method == METHOD_POST || scanner.method == METHOD_PUT)) {
+        if (!scanner.contentLengthProvided && !scanner.transferEncodingProvided) {
+            ret = 501;
+        } else {
+            if (req.body.size() > cfg.bodyLimit)
+                scanner.bodyLimitExceeded = true;
+            else
+                scanner.body = req.body;
+            if (!scanner.contentLengthProvided)
+                scanner.contentLength = scanner.body.length();
+            ret = scanner.processBody();
+        }
+    }
+
+    replay_result_t result;
+    result.ret = ret;
+    result.block = scanner.block;
+    result.drop = scanner.drop;
+    result.scores = std::move(scanner.matchScores);
+    return result;
+}
+
+/* The verdict of a request as a printable line, scores sorted by name */
+static std::string format_verdict(size_t id, const replay_result_t &result) {
+    std::map<std::string, int> scores(result.scores.begin(), result.scores.end());
+    std::ostringstream verdict;
+    verdict << id << " " << result.ret << " block=" << result.block << " drop=" << result.drop;
+    for (const auto &score : scores)
+        verdict << " " << score.first << ":" << score.second;
+    return verdict.str();
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s -r <rules> -c <corpus> [options]\n"
+            "  -r <file>   core.rules and Location-style CheckRule / BasicRule directives (repeatable)\n"
+            "  -c <file>   corpus of raw HTTP requests\n"
+            "  -t <n>      replay threads (default 1)\n"
+            "  -n <n>      passes over the corpus (default 1)\n"
+            "  -o <file>   write the verdicts to file\n"
+            "  -b <file>   compare the verdicts with a baseline written by -o\n"
+            "  -m <file>   write the match log to file\n"
+            "  -l <bytes>  request body limit (default 8388608)\n"
+            "  -L          learning mode\n"
+            "  -E          extensive log\n"
+            "  -S          libinjection SQL\n"
+            "  -X          libinjection XSS\n", prog);
+}
+
+int main(int argc, char **argv) {
+    bench_config_t cfg;
+    std::vector<const char *> rulesPaths;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:c:t:n:o:b:m:l:LESXh")) != -1) {
+        switch (opt) {
+            case 'r': rulesPaths.push_back(optarg); break;
+            case 'c': cfg.corpusPath = optarg; break;
+            case 't': cfg.threads = (unsigned int) std::max(1L, strtol(optarg, NULL, 10)); break;
+            case 'n': cfg.passes = (unsigned int) std::max(1L, strtol(optarg, NULL, 10)); break;
+            case 'o': cfg.verdictsPath = optarg; break;
+            case 'b': cfg.baselinePath = optarg; break;
+            case 'm': cfg.matchlogPath = optarg; break;
+            case 'l': cfg.bodyLimit = strtoul(optarg, NULL, 10); break;
+            case 'L': cfg.learning = true; break;
+            case 'E': cfg.extensive = true; break;
+            case 'S': cfg.libinjSQL = true; break;
+            case 'X': cfg.libinjXSS = true; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (rulesPaths.empty() || cfg.corpusPath == NULL) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Compile the rules as post_config() does
+    std::vector<std::pair<std::string, std::string>> checkRules;
+    std::vector<std::string> basicRules;
+    for (const char *path : rulesPaths)
+        if (!load_rules(path, checkRules, basicRules))
+            return 1;
+    std::string err;
+    unsigned int mainRuleCount = RuleParser::parseMainRules(tmpMainRules, err);
+    if (!err.empty())
+        fprintf(stderr, "MainRules error %s\n", err.c_str());
+    RuleParser parser;
+    err.clear();
+    parser.parseCheckRule(checkRules, err);
+    if (!err.empty())
+        fprintf(stderr, "CheckRule parsing error %s\n", err.c_str());
+    err.clear();
+    unsigned int basicRuleCount = parser.parseBasicRules(basicRules, err);
+    if (!err.empty())
+        fprintf(stderr, "BasicRule parsing error %s\n", err.c_str());
+    parser.generateHashTables();
+
+    std::vector<recorded_request_t> corpus;
+    if (!load_corpus(cfg.corpusPath, corpus))
+        return 1;
+    if (corpus.empty()) {
+        fprintf(stderr, "empty corpus\n");
+        return 1;
+    }
+
+    if (cfg.matchlogPath != NULL) {
+        matchlog_file = fopen(cfg.matchlogPath, "w");
+        if (matchlog_file == NULL) {
+            fprintf(stderr, "cannot open match log %s\n", cfg.matchlogPath);
+            return 1;
+        }
+    }
+
+    // Replay, each thread taking every n-th request of the corpus
+    std::vector<std::string> verdicts(corpus.size());
+    std::vector<std::vector<double>> latencies(cfg.threads);
+    std::vector<unsigned long> allocs(cfg.threads);
+    std::vector<thread_counters_t> counters(cfg.threads);
+    std::atomic<bool> countersAvailable(true);
+    std::vector<std::thread> workers;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int t = 0; t < cfg.threads; t++) {
+        workers.emplace_back([&, t]() {
+            latencies[t].reserve((corpus.size() / cfg.threads + 1) * cfg.passes);
+            unsigned long allocsBefore = thread_allocs, formatAllocs = 0;
+            counters_start(&counters[t]);
+            for (unsigned int pass = 0; pass < cfg.passes; pass++) {
+                for (size_t i = t; i < corpus.size(); i += cfg.threads) {
+                    auto begin = std::chrono::steady_clock::now();
+                    replay_result_t result = replay(parser, cfg, corpus[i], i);
+                    auto end = std::chrono::steady_clock::now();
+                    latencies[t].push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+                    if (pass == 0) {
+                        // Formatting is not part of a scan: neither timed, counted nor measured
+                        counters_pause(&counters[t], true);
+                        unsigned long formatBefore = thread_allocs;
+                        verdicts[i] = format_verdict(i, result);
+                        formatAllocs += thread_allocs - formatBefore;
+                        counters_pause(&counters[t], false);
+                    }
+                }
+            }
+            if (!counters_stop(&counters[t]))
+                countersAvailable = false;
+            allocs[t] = thread_allocs - allocsBefore - formatAllocs;
+        });
+    }
+    for (auto &worker : workers)
+        worker.join();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    if (matchlog_file != NULL)
+        fclose(matchlog_file);
+
+    std::vector<double> all;
+    unsigned long totalAllocs = 0;
+    unsigned long long totals[COUNTER_COUNT] = {0};
+    for (unsigned int t = 0; t < cfg.threads; t++) {
+        all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+        totalAllocs += allocs[t];
+        for (int i = 0; i < COUNTER_COUNT; i++)
+            totals[i] += counters[t].values[i];
+    }
+    std::sort(all.begin(), all.end());
+    auto percentile = [&all](double p) {
+        return all[std::min(all.size() - 1, (size_t) (p * all.size()))];
+    };
+
+    size_t blocked = 0;
+    for (const auto &verdict : verdicts)
+        if (verdict.find(" block=1") != std::string::npos)
+            blocked++;
+
+    printf("rules:        %u MainRules, %lu CheckRules, %u BasicRules\n", mainRuleCount, parser.checkRules.size(),
+           basicRuleCount);
+    printf("requests:     %lu x %u passes on %u threads\n", corpus.size(), cfg.passes, cfg.threads);
+    printf("throughput:   %.0f req/s\n", all.size() / elapsed);
+    printf("latency (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n", percentile(0.50), percentile(0.99),
+           percentile(0.999), all.back());
+    printf("allocations:  %.1f per request\n", (double) totalAllocs / all.size());
+    if (countersAvailable && totals[COUNTER_CYCLES] > 0 && totals[COUNTER_BRANCHES] > 0) {
+        printf("instructions: %.0f per request, %.2f per cycle\n", (double) totals[COUNTER_INSTRUCTIONS] / all.size(),
+               (double) totals[COUNTER_INSTRUCTIONS] / totals[COUNTER_CYCLES]);
+        printf("branches:     %.0f per request, %.1f missed (%.2f%%)\n", (double) totals[COUNTER_BRANCHES] / all.size(),
+               (double) totals[COUNTER_BRANCH_MISSES] / all.size(),
+               100.0 * totals[COUNTER_BRANCH_MISSES] / totals[COUNTER_BRANCHES]);
+    } else {
+        printf("instructions: unavailable (perf events not permitted)\n");
+    }
+    printf("blocked:      %lu / %lu\n", blocked, corpus.size());
+
+    if (cfg.verdictsPath != NULL) {
+        std::ofstream out(cfg.verdictsPath);
+        for (const auto &verdict : verdicts)
+            out << verdict << "\n";
+    }
+
+    int status = 0;
+    if (cfg.baselinePath != NULL) {
+        std::ifstream in(cfg.baselinePath);
+        if (!in) {
+            fprintf(stderr, "cannot open baseline %s\n", cfg.baselinePath);
+            return 1;
+        }
+        std::string line;
+        size_t i = 0, diffs = 0;
+        while (std::getline(in, line) && i < verdicts.size()) {
+            if (line != verdicts[i]) {
+                if (diffs < 20)
+                    printf("  - %s\n  + %s\n", line.c_str(), verdicts[i].c_str());
+                diffs++;
+            }
+            i++;
+        }
+        if (i != verdicts.size())
+            printf("baseline holds %lu verdicts, corpus %lu requests\n", i, verdicts.size());
+        printf("verdict diffs: %lu\n", diffs);
+        status = diffs > 0 || i != verdicts.size();
+    }
+    return status;
+}
@@ -0,0 +1,120 @@
+/*
+ *  url_decode_bench - checks url_decode() against the scalar decoding of
+ *  ap_unescape_url() on random inputs, then times both.
+ *
+ *  Copyright (c) 2017 Annihil
+ *  Released under the GPLv3
+ */
+
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "UrlDecode.hpp"
+
+/* The decoding loop of httpd's unescape_url() as called by ap_unescape_url() */
+static char x2c(const char *what) {
+    char digit;
+    digit = ((what[0] >= 'A') ? ((what[0] & 0xdf) - 'A') + 10 : (what[0] - '0'));
+    digit *= 16;
+    digit += (what[1] >= 'A' ? ((what[1] & 0xdf) - 'A') + 10 : (what[1] - '0'));
+    return digit;
+}
+
+static void reference_decode(char *url) {
+    char *y = strchr(url, '%');
+    if (y == NULL)
+        return;
+    char *x;
+    for (x = y; *y; ++x, ++y) {
+        if (*y != '%') {
+            *x = *y;
+        } else if (!isxdigit((unsigned char) y[1]) || !isxdigit((unsigned char) y[2])) {
+            *x = '%';
+        } else {
+            *x = x2c(y + 1);
+            y += 2;
+        }
+    }
+    *x = '\0';
+}
+
+static std::string random_input(std::mt19937 &rng, size_t maxLen, int escapePct) {
+    static const char alphabet[] = "%%%%0123456789abcdefABCDEFxyzXYZ+/=&-_.~ \x7f\x80\xff";
+    size_t len = rng() % (maxLen + 1);
+    std::string str;
+    for (size_t i = 0; i < len; i++) {
+        if ((int) (rng() % 100) < escapePct)
+            str += alphabet[rng() % (sizeof(alphabet) - 1)];
+        else
+            str += (char) ('a' + rng() % 26);
+    }
+    return str;
+}
+
+/* Whole buffers are compared, bytes left behind the new terminator included */
+static bool check(const std::string &input) {
+    std::vector<char> expected(input.begin(), input.end()), actual(input.begin(), input.end());
+    expected.push_back('\0');
+    actual.push_back('\0');
+    reference_decode(expected.data());
+    url_decode(actual.data());
+    if (expected == actual)
+        return true;
+    printf("mismatch on \"%s\"\n", input.c_str());
+    return false;
+}
+
+template<typename Decoder>
+static double time_decoder(Decoder decode, const std::vector<std::string> &inputs, unsigned int rounds) {
+    std::vector<char> buf;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned int round = 0; round < rounds; round++) {
+        for (const auto &input : inputs) {
+            buf.assign(input.begin(), input.end());
+            buf.push_back('\0');
+            decode(buf.data());
+        }
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    std::mt19937 rng(42);
+
+    // Equivalence
+    static const char *const edgeCases[] = {"", "%", "%%", "%4", "%41", "%4g", "%g4", "a%", "a%4", "%00a", "%2F%2f",
+                                            "%%41", "%41%", "100%", "%e9t%C3%A9", "%u0041", "+%2B+"};
+    unsigned long checked = 0;
+    for (const char *input : edgeCases) {
+        if (!check(input))
+            return 1;
+        checked++;
+    }
+    for (int i = 0; i < 1000000; i++) {
+        if (!check(random_input(rng, 64, i % 100)))
+            return 1;
+        checked++;
+    }
+    printf("equivalence: %lu inputs identical\n", checked);
+
+    // Speed, on query-string-like values with few and with many escapes
+    static const int escapeRates[] = {0, 2, 30};
+    for (int escapePct : escapeRates) {
+        std::vector<std::string> inputs;
+        size_t bytes = 0;
+        for (int i = 0; i < 10000; i++) {
+            inputs.push_back(random_input(rng, 256, escapePct));
+            bytes += inputs.back().size();
+        }
+        const unsigned int rounds = 200;
+        double reference = time_decoder(reference_decode, inputs, rounds);
+        double vectorized = time_decoder(url_decode, inputs, rounds);
+        printf("%2d%% escapes: scalar %7.1f MB/s, url_decode %7.1f MB/s\n", escapePct,
+               bytes * rounds / reference / 1e6, bytes * rounds / vectorized / 1e6);
+    }
+    return 0;
+}
@@ -13,15 +13,43 @@
 #include <http_config.h>
 #include <http_log.h>
 #include <apr_strings.h>
+#include <apr_lib.h>
+#include <apr_shm.h>
+#include <apr_sha1.h>
+#include <apr_thread_pool.h>
 #include <util_script.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <memory>
+#include <map>
+#include <new>
+#include <unordered_map>
 #include "deps/libdefiance/RuntimeScanner.hpp"
+#include "UrlDecode.hpp"
 
 // Extra Apache 2.4+ C++ module declaration
 #ifdef APLOG_USE_MODULE
 APLOG_USE_MODULE(defender);
 #endif
 
+/*
+ * Rules of a location with a RulesFile, replaced as a whole when the file
+ * changes. Requests keep a reference on the snapshot they started with.
+ */
+typedef struct {
+    std::shared_ptr<RuleParser> parser;
+    apr_time_t mtime; // of the RulesFile the rules were compiled from
+} rule_snapshot_t;
+
+struct bypass_t;
+
 /*
  * Per-directory configuration structure
  */
@@ -29,7 +57,11 @@ typedef struct {
     RuleParser *parser;
     std::vector<std::pair<std::string, std::string>> tmpCheckRules;
     std::vector<std::string> tmpBasicRules;
+    const char *rules_file;
+    std::shared_ptr<rule_snapshot_t> *rules; // current rules, only for locations with a RulesFile
+    apr_time_t rules_checked; // RulesFile mtime last compiled, only used by the watcher thread
     char *loc_path;
+    unsigned int stats_slot; // 1-based index of the location in the scoreboard, 0 if none
     apr_file_t *matchlog_file;
     apr_file_t *jsonmatchlog_file;
     unsigned long requestBodyLimit;
@@ -39,31 +71,1544 @@ typedef struct {
     bool learning;
     bool extensive;
     bool useenv;
+    bool upload_skip_content;
+    bool upload_hash;
+    bool verdict_cache;
+    bool offender_tracking;
+    bool learning_aggregate;
+    std::vector<std::string> bypassPrefixes;
+    std::vector<std::string> bypassExtensions;
+    apr_int64_t bypass_methods; // AP_METHOD_BIT << method number
+    bypass_t *bypass; // prefixes and extensions compiled by post_config, NULL if none
+    double learning_sample; // fraction of the requests of a learning location scanned, 0 if all
 } dir_config_t;
 
 std::vector<dir_config_t *> dir_cfgs;
 
-extern module AP_MODULE_DECLARE_DATA defender_module;
+extern module AP_MODULE_DECLARE_DATA defender_module;
+
+static const char defender_in_filter_name[] = "DEFENDER_IN";
+
+/* Custom definition to hold any configuration data we may need. */
+typedef struct {
+    RuntimeScanner *vpRuntimeScanner;
+    RuleParser *parser; // rules the scanner was built with
+    bool offenderRecorded;
+} defender_config_t;
+
+/* Logger info which does not change during the life of a child, set up
+   once in child_init (or per worker thread) instead of on every request. */
+static pid_t child_pid;
+static std::string software_version;
+static thread_local std::string thread_id;
+static thread_local const dir_config_t *log_loc; // location of the request the thread scans
+
+/* Custom function to ensure our RuntimeScanner get's destroyed at the
+   end of the request cycle, its memory belongs to the request pool. */
+static apr_status_t defender_delete_runtimescanner_object(void *inPtr) {
+    if (inPtr)
+        ((RuntimeScanner *) inPtr)->~RuntimeScanner();
+    return OK;
+}
+
+static apr_status_t defender_delete_ruleparser_object(void *inPtr) {
+    if (inPtr) {
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL, "Unloading Defender for a loc");
+        delete (RuleParser *) inPtr;
+    }
+    return OK;
+}
+
+/*
+ * Asynchronous match logging.
+ * Request threads hand their log lines to a bounded lock-free ring (one per
+ * child) and a writer thread flushes it with vectored writes, so that a slow
+ * disk or a full pipe never stalls the scan of a request.
+ */
+typedef struct {
+    unsigned int buffer; // records held by the ring, 0 keeps writes synchronous
+    unsigned int flushSize; // pending records waking the writer up before the interval
+    apr_interval_time_t flushInterval;
+    bool overflowSync; // write from the request thread rather than drop when the ring is full
+} log_config_t;
+
+static const log_config_t default_log_cfg = {0, 64, apr_time_from_msec(500), false};
+static log_config_t log_cfg = default_log_cfg;
+
+#define LOG_RING_IOV_MAX 64
+
+typedef struct {
+    std::atomic<size_t> sequence;
+    apr_file_t *file;
+    std::string line;
+} log_slot_t;
+
+typedef struct {
+    log_slot_t *slots;
+    size_t mask;
+    std::atomic<size_t> enqueuePos;
+    std::atomic<size_t> dequeuePos;
+    std::atomic<unsigned long> dropped;
+    std::atomic<bool> stop;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t *writer;
+} log_ring_t;
+
+static log_ring_t *log_ring;
+
+static bool log_ring_push(log_ring_t *ring, apr_file_t *file, const void *buf, size_t nbytes) {
+    size_t pos = ring->enqueuePos.load(std::memory_order_relaxed);
+    for (;;) {
+        log_slot_t *slot = &ring->slots[pos & ring->mask];
+        size_t seq = slot->sequence.load(std::memory_order_acquire);
+        if (seq == pos) {
+            if (ring->enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (seq < pos) {
+            return false; // ring full
+        } else {
+            pos = ring->enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+    log_slot_t *slot = &ring->slots[pos & ring->mask];
+    slot->file = file;
+    slot->line.assign((const char *) buf, nbytes);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    if (pos + 1 - ring->dequeuePos.load(std::memory_order_relaxed) == log_cfg.flushSize) {
+        apr_thread_mutex_lock(ring->mutex);
+        apr_thread_cond_signal(ring->cond);
+        apr_thread_mutex_unlock(ring->mutex);
+    }
+    return true;
+}
+
+static void log_ring_write(apr_file_t *file, struct iovec *vec, apr_size_t nvec) {
+    apr_size_t written;
+    if (file != NULL && nvec > 0)
+        apr_file_writev_full(file, vec, nvec, &written);
+}
+
+/* Writes every published record, consecutive records of a same file go in one writev */
+static void log_ring_flush(log_ring_t *ring) {
+    struct iovec vec[LOG_RING_IOV_MAX];
+    apr_size_t nvec = 0;
+    apr_file_t *file = NULL;
+    size_t start = ring->dequeuePos.load(std::memory_order_relaxed);
+    size_t pos = start;
+    for (;;) {
+        log_slot_t *slot = &ring->slots[pos & ring->mask];
+        bool published = slot->sequence.load(std::memory_order_acquire) == pos + 1;
+        if (nvec > 0 && (!published || nvec == LOG_RING_IOV_MAX || slot->file != file)) {
+            log_ring_write(file, vec, nvec);
+            // Hand the written slots back to the producers
+            for (; start != pos; start++)
+                ring->slots[start & ring->mask].sequence.store(start + ring->mask + 1, std::memory_order_release);
+            ring->dequeuePos.store(pos, std::memory_order_relaxed);
+            nvec = 0;
+        }
+        if (!published)
+            break;
+        file = slot->file;
+        vec[nvec].iov_base = (void *) slot->line.data();
+        vec[nvec].iov_len = slot->line.size();
+        nvec++;
+        pos++;
+    }
+}
+
+static void *APR_THREAD_FUNC log_ring_writer(apr_thread_t *thread, void *data) {
+    log_ring_t *ring = (log_ring_t *) data;
+    while (!ring->stop.load()) {
+        apr_thread_mutex_lock(ring->mutex);
+        if (!ring->stop.load())
+            apr_thread_cond_timedwait(ring->cond, ring->mutex, log_cfg.flushInterval);
+        apr_thread_mutex_unlock(ring->mutex);
+        log_ring_flush(ring);
+    }
+    log_ring_flush(ring);
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t log_ring_destroy(void *data) {
+    log_ring_t *ring = (log_ring_t *) data;
+    apr_thread_mutex_lock(ring->mutex);
+    ring->stop.store(true);
+    apr_thread_cond_signal(ring->cond);
+    apr_thread_mutex_unlock(ring->mutex);
+    apr_status_t rv;
+    apr_thread_join(&rv, ring->writer);
+    if (ring->dropped.load() > 0)
+        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL, "Defender match log: %lu records dropped (ring full)",
+                     ring->dropped.load());
+    log_ring = NULL;
+    delete[] ring->slots;
+    ring->~log_ring_t();
+    return APR_SUCCESS;
+}
+
+static void log_ring_create(apr_pool_t *p, server_rec *s) {
+    size_t capacity = 2;
+    while (capacity < log_cfg.buffer)
+        capacity <<= 1;
+    // The writer is woken up when exactly flushSize records are pending, which a smaller ring never reaches
+    if (log_cfg.flushSize > capacity / 2)
+        log_cfg.flushSize = (unsigned int) (capacity / 2);
+
+    log_ring_t *ring = new(apr_palloc(p, sizeof(log_ring_t))) log_ring_t();
+    ring->slots = new log_slot_t[capacity];
+    ring->mask = capacity - 1;
+    for (size_t i = 0; i < capacity; i++)
+        ring->slots[i].sequence.store(i, std::memory_order_relaxed);
+    ring->enqueuePos.store(0);
+    ring->dequeuePos.store(0);
+    ring->dropped.store(0);
+    ring->stop.store(false);
+
+    apr_status_t rv = apr_thread_mutex_create(&ring->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_cond_create(&ring->cond, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_create(&ring->writer, NULL, log_ring_writer, ring, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Defender match log: failed to start the writer thread, "
+                "logging synchronously");
+        delete[] ring->slots;
+        ring->~log_ring_t();
+        return;
+    }
+    apr_pool_cleanup_register(p, ring, log_ring_destroy, apr_pool_cleanup_null);
+    log_ring = ring;
+}
+
+/*
+ * Statistics scoreboard.
+ * Per-phase and per-location counters living in an anonymous shared memory
+ * segment created by post_config, so that every child adds to the same
+ * totals. They are served by the "defender-status" handler.
+ */
+enum {
+    PHASE_HEADER_PARSER,
+    PHASE_BODY_READ,
+    PHASE_PROCESS_HEADERS,
+    PHASE_PROCESS_BODY,
+    PHASE_COUNT
+};
+
+static const char *const phase_names[PHASE_COUNT] = {"header_parser", "body_read", "processHeaders", "processBody"};
+
+typedef struct {
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> nsec;
+} phase_counter_t;
+
+typedef struct {
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> blocked;
+    std::atomic<uint64_t> bypassed;
+    std::atomic<uint64_t> nsec;
+} loc_counter_t;
+
+typedef struct {
+    phase_counter_t phases[PHASE_COUNT];
+    std::atomic<uint64_t> logDropped;
+    std::atomic<uint64_t> verdictHits;
+    std::atomic<uint64_t> verdictMisses;
+    std::atomic<uint64_t> offenderBlocks;
+    std::atomic<uint64_t> offenderRejected;
+    unsigned int locCount;
+} scoreboard_t;
+
+static scoreboard_t *scoreboard;
+static std::vector<const char *> scoreboard_locs;
+
+static inline uint64_t stats_clock() {
+    return (uint64_t) std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline loc_counter_t *stats_loc(const dir_config_t *dcfg) {
+    if (scoreboard == NULL || dcfg->stats_slot == 0 || dcfg->stats_slot > scoreboard->locCount)
+        return NULL;
+    return (loc_counter_t *) (scoreboard + 1) + dcfg->stats_slot - 1;
+}
+
+/* Accounts a phase started at start, returns its duration */
+static inline uint64_t stats_phase(int phase, uint64_t start) {
+    uint64_t elapsed = stats_clock() - start;
+    if (scoreboard != NULL) {
+        scoreboard->phases[phase].count.fetch_add(1, std::memory_order_relaxed);
+        scoreboard->phases[phase].nsec.fetch_add(elapsed, std::memory_order_relaxed);
+    }
+    return elapsed;
+}
+
+static void stats_request(const dir_config_t *dcfg, uint64_t start, int ret, bool first) {
+    uint64_t elapsed = stats_clock() - start;
+    loc_counter_t *loc = stats_loc(dcfg);
+    if (loc == NULL)
+        return;
+    if (first)
+        loc->requests.fetch_add(1, std::memory_order_relaxed);
+    if (ret != OK && ret != DECLINED)
+        loc->blocked.fetch_add(1, std::memory_order_relaxed);
+    loc->nsec.fetch_add(elapsed, std::memory_order_relaxed);
+}
+
+static void scoreboard_create(apr_pool_t *pconf, server_rec *s) {
+    scoreboard = NULL;
+    apr_size_t size = sizeof(scoreboard_t) + scoreboard_locs.size() * sizeof(loc_counter_t);
+    apr_shm_t *shm;
+    apr_status_t rv = apr_shm_create(&shm, size, NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Defender: failed to create the statistics scoreboard");
+        return;
+    }
+    scoreboard_t *sb = new(apr_shm_baseaddr_get(shm)) scoreboard_t();
+    sb->locCount = (unsigned int) scoreboard_locs.size();
+    loc_counter_t *locs = (loc_counter_t *) (sb + 1);
+    for (unsigned int i = 0; i < sb->locCount; i++)
+        new(&locs[i]) loc_counter_t();
+    scoreboard = sb;
+}
+
+static std::string json_escape(const char *str) {
+    std::string escaped;
+    for (; *str; str++) {
+        if (*str == '"' || *str == '\\')
+            escaped += '\\';
+        if ((unsigned char) *str < 0x20)
+            continue;
+        escaped += *str;
+    }
+    return escaped;
+}
+
+/*
+ * The "defender-status" handler, enabled with SetHandler defender-status.
+ * Plain text by default, JSON when the query string is "json".
+ */
+static int status_handler(request_rec *r) {
+    if (r->handler == NULL || strcmp(r->handler, "defender-status"))
+        return DECLINED;
+    if (r->method_number != M_GET)
+        return HTTP_METHOD_NOT_ALLOWED;
+
+    bool json = r->args != NULL && !strcasecmp(r->args, "json");
+    ap_set_content_type(r, json ? "application/json" : "text/plain; charset=ISO-8859-1");
+    if (r->header_only)
+        return OK;
+
+    if (scoreboard == NULL) {
+        ap_rputs(json ? "{}\n" : "Defender statistics unavailable\n", r);
+        return OK;
+    }
+
+    const loc_counter_t *locs = (const loc_counter_t *) (scoreboard + 1);
+    if (json) {
+        ap_rputs("{\"phases\":{", r);
+        for (int i = 0; i < PHASE_COUNT; i++)
+            ap_rprintf(r, "%s\"%s\":{\"count\":%" APR_UINT64_T_FMT ",\"nsec\":%" APR_UINT64_T_FMT "}",
+                       i ? "," : "", phase_names[i], (apr_uint64_t) scoreboard->phases[i].count.load(),
+                       (apr_uint64_t) scoreboard->phases[i].nsec.load());
+        ap_rprintf(r, "},\"log_dropped\":%" APR_UINT64_T_FMT ",\"verdict_cache\":{\"hits\":%" APR_UINT64_T_FMT
+                ",\"misses\":%" APR_UINT64_T_FMT "},\"offenders\":{\"blocks\":%" APR_UINT64_T_FMT ",\"rejected\":%"
+                APR_UINT64_T_FMT "},\"locations\":[", (apr_uint64_t) scoreboard->logDropped.load(),
+                   (apr_uint64_t) scoreboard->verdictHits.load(), (apr_uint64_t) scoreboard->verdictMisses.load(),
+                   (apr_uint64_t) scoreboard->offenderBlocks.load(), (apr_uint64_t) scoreboard->offenderRejected.load());
+        for (unsigned int i = 0; i < scoreboard->locCount; i++)
+            ap_rprintf(r, "%s{\"path\":\"%s\",\"requests\":%" APR_UINT64_T_FMT ",\"blocked\":%" APR_UINT64_T_FMT
+                    ",\"bypassed\":%" APR_UINT64_T_FMT ",\"nsec\":%" APR_UINT64_T_FMT "}", i ? "," : "",
+                       json_escape(i < scoreboard_locs.size() ? scoreboard_locs[i] : "").c_str(),
+                       (apr_uint64_t) locs[i].requests.load(), (apr_uint64_t) locs[i].blocked.load(),
+                       (apr_uint64_t) locs[i].bypassed.load(), (apr_uint64_t) locs[i].nsec.load());
+        ap_rputs("]}\n", r);
+        return OK;
+    }
+
+    ap_rputs("Defender Status\n\n", r);
+    ap_rprintf(r, "%-16s %14s %14s %12s\n", "Phase", "Calls", "Total ms", "Avg us");
+    for (int i = 0; i < PHASE_COUNT; i++) {
+        uint64_t count = scoreboard->phases[i].count.load(), nsec = scoreboard->phases[i].nsec.load();
+        ap_rprintf(r, "%-16s %14" APR_UINT64_T_FMT " %14.3f %12.3f\n", phase_names[i], (apr_uint64_t) count,
+                   nsec / 1e6, count ? nsec / 1e3 / count : 0.0);
+    }
+    ap_rprintf(r, "\nMatch log records dropped: %" APR_UINT64_T_FMT "\n",
+               (apr_uint64_t) scoreboard->logDropped.load());
+    ap_rprintf(r, "Verdict cache hits: %" APR_UINT64_T_FMT ", misses: %" APR_UINT64_T_FMT "\n",
+               (apr_uint64_t) scoreboard->verdictHits.load(), (apr_uint64_t) scoreboard->verdictMisses.load());
+    ap_rprintf(r, "Offender blocks recorded: %" APR_UINT64_T_FMT ", requests rejected: %" APR_UINT64_T_FMT "\n\n",
+               (apr_uint64_t) scoreboard->offenderBlocks.load(), (apr_uint64_t) scoreboard->offenderRejected.load());
+    ap_rprintf(r, "%-32s %14s %14s %14s %14s %12s\n", "Location", "Requests", "Blocked", "Bypassed", "Total ms",
+               "Avg us");
+    for (unsigned int i = 0; i < scoreboard->locCount; i++) {
+        uint64_t requests = locs[i].requests.load(), nsec = locs[i].nsec.load();
+        ap_rprintf(r, "%-32s %14" APR_UINT64_T_FMT " %14" APR_UINT64_T_FMT " %14" APR_UINT64_T_FMT " %14.3f %12.3f\n",
+                   i < scoreboard_locs.size() ? scoreboard_locs[i] : "", (apr_uint64_t) requests,
+                   (apr_uint64_t) locs[i].blocked.load(), (apr_uint64_t) locs[i].bypassed.load(), nsec / 1e6,
+                   requests ? nsec / 1e3 / requests : 0.0);
+    }
+    return OK;
+}
+
+static int log_write(apr_file_t *file, const void *buf, size_t *nbytes) {
+    log_ring_t *ring = log_ring;
+    if (ring != NULL) {
+        if (log_ring_push(ring, file, buf, *nbytes))
+            return APR_SUCCESS;
+        if (!log_cfg.overflowSync) {
+            ring->dropped++;
+            if (scoreboard != NULL)
+                scoreboard->logDropped.fetch_add(1, std::memory_order_relaxed);
+            return APR_SUCCESS;
+        }
+    }
+    return apr_file_write(file, buf, nbytes);
+}
+
+/*
+ * Learning aggregation.
+ * In locations with LearningAggregate On, the NAXSI_FMT and NAXSI_EXLOG
+ * lines of the MatchLog are not written one by one: each child counts the
+ * (location, rule id, zone, variable name, uri) tuples they report, keeps a
+ * few sample values, and writes one NAXSI_AGG record per tuple along with a
+ * candidate whitelist (NAXSI_WL) every LearningAggregateFlush seconds.
+ */
+typedef struct {
+    apr_interval_time_t interval;
+    unsigned int samples; // sample values kept per tuple, taken from NAXSI_EXLOG content
+    size_t maxTuples; // beyond, new tuples are logged as usual until the next flush
+} learning_agg_config_t;
+
+static const learning_agg_config_t default_learning_agg_cfg = {apr_time_from_sec(60), 3, 100000};
+static learning_agg_config_t learning_agg_cfg = default_learning_agg_cfg;
+
+typedef struct {
+    apr_file_t *file;
+    const char *loc;
+    std::string id;
+    std::string zone;
+    std::string varName;
+    std::string uri;
+    unsigned long count;
+    std::vector<std::string> samples;
+} learning_tuple_t;
+
+typedef std::unordered_map<std::string, learning_tuple_t> learning_tuples_t;
+
+typedef struct {
+    learning_tuples_t tuples;
+    std::atomic<bool> stop;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t *flusher;
+} learning_agg_t;
+
+static learning_agg_t *learning_agg;
+static bool learning_agg_used; // by a location, set by post_config
+
+/* Splits the key=value&key=value part of a NAXSI line */
+static void learning_fields(const char *args, const char *end, std::map<std::string, std::string> &fields) {
+    while (args < end) {
+        const char *amp = (const char *) memchr(args, '&', end - args);
+        if (amp == NULL)
+            amp = end;
+        const char *eq = (const char *) memchr(args, '=', amp - args);
+        if (eq != NULL)
+            fields[std::string(args, eq)] = std::string(eq + 1, amp);
+        args = amp + 1;
+    }
+}
+
+typedef struct {
+    std::string id;
+    std::string zone;
+    std::string varName;
+} learning_match_t;
+
+/*
+ * Counts the matches of a line, or adds a sample value to their tuple when
+ * count is 0. All or none: false, nothing being counted, if the table has no
+ * room left for the new tuples of the line.
+ */
+static bool learning_count(const dir_config_t *dcfg, apr_file_t *file, const std::vector<learning_match_t> &matches,
+                           const std::string &uri, unsigned long count, const std::string *sample) {
+    std::vector<std::string> keys;
+    for (const auto &match : matches) {
+        std::string key = match.id;
+        key += '\x1f';
+        key += match.zone;
+        key += '\x1f';
+        key += match.varName;
+        key += '\x1f';
+        key += uri;
+        key += '\x1f';
+        key += dcfg->loc_path;
+        keys.push_back(key);
+    }
+
+    apr_thread_mutex_lock(learning_agg->mutex);
+    std::vector<std::string> added;
+    for (const auto &key : keys) {
+        if (!learning_agg->tuples.count(key) && std::find(added.begin(), added.end(), key) == added.end())
+            added.push_back(key);
+    }
+    if (learning_agg->tuples.size() + added.size() > learning_agg_cfg.maxTuples) {
+        apr_thread_mutex_unlock(learning_agg->mutex);
+        return false;
+    }
+    for (size_t i = 0; i < keys.size(); i++) {
+        auto tuple = learning_agg->tuples.find(keys[i]);
+        if (tuple == learning_agg->tuples.end()) {
+            learning_tuple_t &tupleAdded = learning_agg->tuples[keys[i]];
+            tupleAdded.file = file;
+            tupleAdded.loc = dcfg->loc_path;
+            tupleAdded.id = matches[i].id;
+            tupleAdded.zone = matches[i].zone;
+            tupleAdded.varName = matches[i].varName;
+            tupleAdded.uri = uri;
+            tupleAdded.count = 0;
+            tuple = learning_agg->tuples.find(keys[i]);
+        }
+        tuple->second.count += count;
+        if (sample != NULL && tuple->second.samples.size() < learning_agg_cfg.samples &&
+            std::find(tuple->second.samples.begin(), tuple->second.samples.end(), *sample) ==
+            tuple->second.samples.end())
+            tuple->second.samples.push_back(*sample);
+    }
+    apr_thread_mutex_unlock(learning_agg->mutex);
+    return true;
+}
+
+/*
+ * Takes in the NAXSI_FMT / NAXSI_EXLOG line of [line, end), false if it has to be logged as is.
+ * Its key=value part stops at the ", client: ..., request: ..." trailer, as NXAPI reads it.
+ */
+static bool learning_aggregate_line(const dir_config_t *dcfg, apr_file_t *file, const char *line, const char *end) {
+    static const char fmtTag[] = "NAXSI_FMT: ", exlogTag[] = "NAXSI_EXLOG: ", trailer[] = ", client: ";
+    std::string text(line, end);
+    std::map<std::string, std::string> fields;
+    size_t pos;
+    bool fmt = (pos = text.find(fmtTag)) != std::string::npos;
+    if (fmt)
+        pos += sizeof(fmtTag) - 1;
+    else if ((pos = text.find(exlogTag)) != std::string::npos)
+        pos += sizeof(exlogTag) - 1;
+    else
+        return false;
+    size_t fieldsEnd = text.find(trailer, pos);
+    if (fieldsEnd == std::string::npos)
+        fieldsEnd = text.size();
+    learning_fields(text.c_str() + pos, text.c_str() + fieldsEnd, fields);
+
+    std::vector<learning_match_t> matches;
+    if (fmt) {
+        for (unsigned int i = 0; fields.count("id" + std::to_string(i)); i++) {
+            std::string n = std::to_string(i);
+            matches.push_back({fields["id" + n], fields["zone" + n], fields["var_name" + n]});
+        }
+        return learning_count(dcfg, file, matches, fields["uri"], 1, NULL);
+    }
+    matches.push_back({fields["id"], fields["zone"], fields["var_name"]});
+    return learning_count(dcfg, file, matches, fields["uri"], 0, &fields["content"]);
+}
+
+/* Lines of a scanner write that are not aggregated are logged as usual */
+static void learning_aggregate(const dir_config_t *dcfg, apr_file_t *file, const char *buf, size_t nbytes) {
+    const char *end = buf + nbytes;
+    while (buf < end) {
+        const char *eol = (const char *) memchr(buf, '\n', end - buf);
+        const char *next = eol != NULL ? eol + 1 : end;
+        const char *lineEnd = eol != NULL ? eol : end;
+        if (lineEnd > buf && lineEnd[-1] == '\r')
+            lineEnd--;
+        if (!learning_aggregate_line(dcfg, file, buf, lineEnd)) {
+            size_t len = next - buf;
+            log_write(file, buf, &len);
+        }
+        buf = next;
+    }
+}
+
+/* Match zone of a candidate whitelist, like NXAPI writes them */
+static std::string learning_match_zone(const learning_tuple_t &tuple) {
+    std::string zone = tuple.zone;
+    size_t name = zone.find("|NAME");
+    if (name != std::string::npos)
+        zone.erase(name);
+    std::string mz = "$URL:" + tuple.uri;
+    if (!tuple.varName.empty() && (zone == "ARGS" || zone == "BODY" || zone == "HEADERS"))
+        mz += "|$" + zone + "_VAR:" + tuple.varName;
+    else
+        mz += "|" + zone;
+    if (name != std::string::npos)
+        mz += "|NAME";
+    return mz;
+}
+
+static void learning_agg_flush(learning_agg_t *agg) {
+    learning_tuples_t tuples;
+    apr_thread_mutex_lock(agg->mutex);
+    tuples.swap(agg->tuples);
+    apr_thread_mutex_unlock(agg->mutex);
+    if (tuples.empty())
+        return;
+
+    char date[32];
+    apr_size_t dateLen;
+    apr_time_exp_t now;
+    apr_time_exp_lt(&now, apr_time_now());
+    apr_strftime(date, &dateLen, sizeof(date), "%Y/%m/%d %H:%M:%S", &now);
+    std::string prefix = std::string(date, dateLen) + " [notice] " + std::to_string(child_pid) + ": ";
+
+    for (const auto &entry : tuples) {
+        const learning_tuple_t &tuple = entry.second;
+        if (tuple.count == 0)
+            continue;
+        std::string line = prefix + "NAXSI_AGG: loc=" + tuple.loc + "&uri=" + tuple.uri + "&id=" + tuple.id +
+                           "&zone=" + tuple.zone + "&var_name=" + tuple.varName + "&count=" +
+                           std::to_string(tuple.count);
+        for (size_t i = 0; i < tuple.samples.size(); i++)
+            line += "&sample" + std::to_string(i) + "=" + tuple.samples[i];
+        line += "\n" + prefix + "NAXSI_WL: BasicRule wl:" + tuple.id + " \"mz:" + learning_match_zone(tuple) +
+                "\";\n";
+        size_t len = line.size();
+        log_write(tuple.file, line.data(), &len);
+    }
+}
+
+static void *APR_THREAD_FUNC learning_agg_run(apr_thread_t *thread, void *data) {
+    learning_agg_t *agg = (learning_agg_t *) data;
+    while (!agg->stop.load()) {
+        apr_thread_mutex_lock(agg->mutex);
+        if (!agg->stop.load())
+            apr_thread_cond_timedwait(agg->cond, agg->mutex, learning_agg_cfg.interval);
+        apr_thread_mutex_unlock(agg->mutex);
+        learning_agg_flush(agg);
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+/* Writes what the child counted since the last flush before it exits */
+static apr_status_t learning_agg_destroy(void *data) {
+    learning_agg_t *agg = (learning_agg_t *) data;
+    apr_thread_mutex_lock(agg->mutex);
+    agg->stop.store(true);
+    apr_thread_cond_signal(agg->cond);
+    apr_thread_mutex_unlock(agg->mutex);
+    apr_status_t rv;
+    apr_thread_join(&rv, agg->flusher);
+    learning_agg = NULL;
+    learning_agg_flush(agg);
+    agg->~learning_agg_t();
+    return APR_SUCCESS;
+}
+
+static void learning_agg_create(apr_pool_t *p, server_rec *s) {
+    learning_agg_t *agg = new(apr_palloc(p, sizeof(learning_agg_t))) learning_agg_t();
+    agg->stop.store(false);
+    apr_status_t rv = apr_thread_mutex_create(&agg->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_cond_create(&agg->cond, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_create(&agg->flusher, NULL, learning_agg_run, agg, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Defender: failed to start the learning aggregation thread, "
+                "matches are logged one by one");
+        agg->~learning_agg_t();
+        return;
+    }
+    apr_pool_cleanup_register(p, agg, learning_agg_destroy, apr_pool_cleanup_null);
+    learning_agg = agg;
+}
+
+/* Only the match logs go through the ring, anything else (the error log) is written as is */
+static int write_log(void *thefile, const void *buf, size_t *nbytes) {
+    const dir_config_t *dcfg = log_loc;
+    if (dcfg == NULL || (thefile != dcfg->matchlog_file && thefile != dcfg->jsonmatchlog_file))
+        return apr_file_write((apr_file_t *) thefile, buf, nbytes);
+    if (learning_agg != NULL && dcfg->learning_aggregate && thefile == dcfg->matchlog_file) {
+        learning_aggregate(dcfg, (apr_file_t *) thefile, (const char *) buf, *nbytes);
+        return APR_SUCCESS;
+    }
+    return log_write((apr_file_t *) thefile, buf, nbytes);
+}
+
+/*
+ * Verdict cache.
+ * GET requests found clean (no match at all) are remembered in a shared
+ * memory cache so that the same request is not scanned again until the
+ * entry expires. The key is a SipHash, seeded at each restart, of the
+ * location, the mtime of its RulesFile (a reload changes every key), the
+ * path, the query string and every header. The cache is split in small
+ * LRU sets each behind its own spinlock.
+ */
+#define VERDICT_CACHE_WAYS 4
+
+static apr_size_t verdict_cache_size = 16384;
+static apr_interval_time_t verdict_cache_ttl = apr_time_from_sec(60);
+
+typedef struct {
+    uint64_t tag; // key of the request, 0 if the way is empty
+    apr_time_t expires;
+    apr_time_t used;
+} verdict_way_t;
+
+typedef struct {
+    std::atomic<unsigned int> lock;
+    verdict_way_t ways[VERDICT_CACHE_WAYS];
+} verdict_set_t;
+
+typedef struct {
+    uint64_t seed[2];
+    apr_size_t setCount; // power of two
+} verdict_cache_t;
+
+static verdict_cache_t *verdict_cache;
+
+typedef struct {
+    uint64_t v0, v1, v2, v3;
+    uint64_t tail; // bytes not yet hashed, little endian
+    uint64_t len;
+} siphash_t;
+
+#define SIPHASH_ROTL(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+static inline void siphash_round(siphash_t *h) {
+    h->v0 += h->v1;
+    h->v1 = SIPHASH_ROTL(h->v1, 13) ^ h->v0;
+    h->v0 = SIPHASH_ROTL(h->v0, 32);
+    h->v2 += h->v3;
+    h->v3 = SIPHASH_ROTL(h->v3, 16) ^ h->v2;
+    h->v0 += h->v3;
+    h->v3 = SIPHASH_ROTL(h->v3, 21) ^ h->v0;
+    h->v2 += h->v1;
+    h->v1 = SIPHASH_ROTL(h->v1, 17) ^ h->v2;
+    h->v2 = SIPHASH_ROTL(h->v2, 32);
+}
+
+static inline void siphash_block(siphash_t *h, uint64_t m) {
+    h->v3 ^= m;
+    siphash_round(h);
+    siphash_round(h);
+    h->v0 ^= m;
+}
+
+static void siphash_init(siphash_t *h, const uint64_t seed[2]) {
+    h->v0 = 0x736f6d6570736575ULL ^ seed[0];
+    h->v1 = 0x646f72616e646f6dULL ^ seed[1];
+    h->v2 = 0x6c7967656e657261ULL ^ seed[0];
+    h->v3 = 0x7465646279746573ULL ^ seed[1];
+    h->tail = 0;
+    h->len = 0;
+}
+
+static void siphash_update(siphash_t *h, const void *data, size_t len) {
+    const unsigned char *p = (const unsigned char *) data;
+    while (len > 0) {
+        if ((h->len & 7) == 0 && len >= 8) {
+            uint64_t m = 0;
+            for (int i = 0; i < 8; i++)
+                m |= (uint64_t) p[i] << (8 * i);
+            siphash_block(h, m);
+            p += 8;
+            len -= 8;
+            h->len += 8;
+        } else {
+            h->tail |= (uint64_t) *p++ << (8 * (h->len & 7));
+            len--;
+            if ((++h->len & 7) == 0) {
+                siphash_block(h, h->tail);
+                h->tail = 0;
+            }
+        }
+    }
+}
+
+static uint64_t siphash_final(siphash_t *h) {
+    siphash_block(h, (h->len << 56) | h->tail);
+    h->v2 ^= 0xff;
+    for (int i = 0; i < 4; i++)
+        siphash_round(h);
+    return h->v0 ^ h->v1 ^ h->v2 ^ h->v3;
+}
+
+/* Hashes a string along with its length so that fields cannot run into each other */
+static inline void siphash_field(siphash_t *h, const char *str) {
+    uint64_t len = str != NULL ? strlen(str) : UINT64_MAX;
+    siphash_update(h, &len, sizeof(len));
+    if (str != NULL)
+        siphash_update(h, str, (size_t) len);
+}
+
+static void verdict_cache_create(apr_pool_t *pconf, server_rec *s) {
+    verdict_cache = NULL;
+    apr_size_t setCount = 1;
+    while (setCount * VERDICT_CACHE_WAYS < verdict_cache_size)
+        setCount <<= 1;
+    apr_shm_t *shm;
+    apr_status_t rv = apr_shm_create(&shm, sizeof(verdict_cache_t) + setCount * sizeof(verdict_set_t), NULL, pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Defender: failed to create the verdict cache");
+        return;
+    }
+    verdict_cache_t *cache = (verdict_cache_t *) apr_shm_baseaddr_get(shm);
+    rv = apr_generate_random_bytes((unsigned char *) cache->seed, sizeof(cache->seed));
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Defender: failed to seed the verdict cache");
+        return;
+    }
+    cache->setCount = setCount;
+    verdict_set_t *sets = (verdict_set_t *) (cache + 1);
+    for (apr_size_t i = 0; i < setCount; i++)
+        new(&sets[i]) verdict_set_t();
+    verdict_cache = cache;
+}
+
+static uint64_t verdict_cache_key(request_rec *r, const dir_config_t *dcfg, apr_time_t rulesMtime) {
+    siphash_t h;
+    siphash_init(&h, verdict_cache->seed);
+    uint64_t rules[2] = {dcfg->stats_slot, (uint64_t) rulesMtime};
+    siphash_update(&h, rules, sizeof(rules));
+    siphash_field(&h, r->parsed_uri.path);
+    siphash_field(&h, r->args);
+    const apr_array_header_t *headerFields = apr_table_elts(r->headers_in);
+    apr_table_entry_t *headerEntry = (apr_table_entry_t *) headerFields->elts;
+    for (int i = 0; i < headerFields->nelts; i++) {
+        siphash_field(&h, headerEntry[i].key);
+        siphash_field(&h, headerEntry[i].val);
+    }
+    uint64_t key = siphash_final(&h);
+    return key != 0 ? key : 1;
+}
+
+/* A set left locked by a crashed child is simply never used again, the requests mapping to it are scanned */
+static inline verdict_set_t *verdict_cache_lock(uint64_t key) {
+    verdict_set_t *set = (verdict_set_t *) (verdict_cache + 1) + (key & (verdict_cache->setCount - 1));
+    for (int i = 0; i < 64; i++) {
+        if (set->lock.exchange(1, std::memory_order_acquire) == 0)
+            return set;
+    }
+    return NULL;
+}
+
+static inline void verdict_cache_unlock(verdict_set_t *set) {
+    set->lock.store(0, std::memory_order_release);
+}
+
+static bool verdict_cache_lookup(uint64_t key, apr_time_t now) {
+    bool hit = false;
+    verdict_set_t *set = verdict_cache_lock(key);
+    if (set != NULL) {
+        for (int i = 0; i < VERDICT_CACHE_WAYS; i++) {
+            verdict_way_t *way = &set->ways[i];
+            if (way->tag == key && way->expires > now) {
+                way->used = now;
+                hit = true;
+                break;
+            }
+        }
+        verdict_cache_unlock(set);
+    }
+    if (scoreboard != NULL)
+        (hit ? scoreboard->verdictHits : scoreboard->verdictMisses).fetch_add(1, std::memory_order_relaxed);
+    return hit;
+}
+
+/* Takes the way of the same key if any, otherwise the least recently used one, expired ones first */
+static void verdict_cache_store(uint64_t key, apr_time_t now) {
+    verdict_set_t *set = verdict_cache_lock(key);
+    if (set == NULL)
+        return;
+    verdict_way_t *victim = &set->ways[0];
+    for (int i = 0; i < VERDICT_CACHE_WAYS; i++) {
+        verdict_way_t *way = &set->ways[i];
+        if (way->tag == key) {
+            victim = way;
+            break;
+        }
+        apr_time_t used = way->expires > now ? way->used : 0;
+        apr_time_t victimUsed = victim->expires > now ? victim->used : 0;
+        if (used < victimUsed)
+            victim = way;
+    }
+    victim->tag = key;
+    victim->expires = now + verdict_cache_ttl;
+    victim->used = now;
+    verdict_cache_unlock(set);
+}
+
+/*
+ * Offender tracking.
+ * Every block a client IP gets adds 1 to its score in a table shared by the
+ * children, the score halving every OffenderHalfLife. Once it reaches
+ * OffenderThreshold, the requests of this client are rejected (after an
+ * optional tarpit delay) before a scanner is even allocated. The delay holds
+ * the worker thread, so it is kept short: an offender opening many
+ * connections must not be able to tie up every worker.
+ */
+#define OFFENDER_SLOTS 8
+#define OFFENDER_TARPIT_MAX 1000 // milliseconds
+
+typedef struct {
+    apr_size_t size;
+    double threshold;
+    apr_interval_time_t halfLife;
+    apr_interval_time_t tarpit;
+    apr_array_header_t *allow; // apr_ipsubnet_t *, never tracked
+} offender_config_t;
+
+static const offender_config_t default_offender_cfg = {65536, 5, apr_time_from_sec(60), 0, NULL};
+static offender_config_t offender_cfg = default_offender_cfg;
+
+typedef struct {
+    uint64_t ip; // SipHash of the client IP, 0 if the slot is free
+    double score;
+    apr_time_t updated;
+} offender_slot_t;
+
+typedef struct {
+    std::atomic<unsigned int> lock;
+    offender_slot_t slots[OFFENDER_SLOTS];
+} offender_bucket_t;
+
+typedef struct {
+    uint64_t seed[2];
+    apr_size_t bucketCount; // power of two
+} offender_table_t;
+
+static offender_table_t *offender_table;
+
+static void offender_table_create(apr_pool_t *pconf, server_rec *s) {
+    offender_table = NULL;
+    apr_size_t bucketCount = 1;
+    while (bucketCount * OFFENDER_SLOTS < offender_cfg.size)
+        bucketCount <<= 1;
+    apr_shm_t *shm;
+    apr_status_t rv = apr_shm_create(&shm, sizeof(offender_table_t) + bucketCount * sizeof(offender_bucket_t), NULL,
+                                     pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Defender: failed to create the offender table");
+        return;
+    }
+    offender_table_t *table = (offender_table_t *) apr_shm_baseaddr_get(shm);
+    rv = apr_generate_random_bytes((unsigned char *) table->seed, sizeof(table->seed));
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Defender: failed to seed the offender table");
+        return;
+    }
+    table->bucketCount = bucketCount;
+    offender_bucket_t *buckets = (offender_bucket_t *) (table + 1);
+    for (apr_size_t i = 0; i < bucketCount; i++)
+        new(&buckets[i]) offender_bucket_t();
+    offender_table = table;
+}
+
+static bool offender_allowed(request_rec *r) {
+    if (offender_cfg.allow == NULL)
+        return false;
+    for (int i = 0; i < offender_cfg.allow->nelts; i++) {
+        if (apr_ipsubnet_test(APR_ARRAY_IDX(offender_cfg.allow, i, apr_ipsubnet_t *), r->useragent_addr))
+            return true;
+    }
+    return false;
+}
+
+static inline double offender_decay(const offender_slot_t *slot, apr_time_t now) {
+    if (now <= slot->updated)
+        return slot->score;
+    return slot->score * exp2(-(double) (now - slot->updated) / offender_cfg.halfLife);
+}
+
+/* Same locking as the verdict cache, a bucket left locked by a crashed child stops tracking its clients */
+static inline offender_bucket_t *offender_lock(uint64_t ip) {
+    offender_bucket_t *bucket = (offender_bucket_t *) (offender_table + 1) + (ip & (offender_table->bucketCount - 1));
+    for (int i = 0; i < 64; i++) {
+        if (bucket->lock.exchange(1, std::memory_order_acquire) == 0)
+            return bucket;
+    }
+    return NULL;
+}
+
+static inline void offender_unlock(offender_bucket_t *bucket) {
+    bucket->lock.store(0, std::memory_order_release);
+}
+
+static uint64_t offender_key(request_rec *r) {
+    siphash_t h;
+    siphash_init(&h, offender_table->seed);
+    siphash_field(&h, r->useragent_ip);
+    uint64_t ip = siphash_final(&h);
+    return ip != 0 ? ip : 1;
+}
+
+/* Current score of the client of r */
+static double offender_score(request_rec *r) {
+    uint64_t ip = offender_key(r);
+    double score = 0;
+    offender_bucket_t *bucket = offender_lock(ip);
+    if (bucket == NULL)
+        return 0;
+    for (int i = 0; i < OFFENDER_SLOTS; i++) {
+        if (bucket->slots[i].ip == ip) {
+            score = offender_decay(&bucket->slots[i], r->request_time);
+            break;
+        }
+    }
+    offender_unlock(bucket);
+    return score;
+}
+
+/* Adds a block to the score of the client, taking the slot of the lowest score when it is not tracked yet */
+static void offender_record(request_rec *r) {
+    uint64_t ip = offender_key(r);
+    offender_bucket_t *bucket = offender_lock(ip);
+    if (bucket == NULL)
+        return;
+    offender_slot_t *slot = NULL;
+    double lowest = 0;
+    for (int i = 0; i < OFFENDER_SLOTS; i++) {
+        offender_slot_t *candidate = &bucket->slots[i];
+        if (candidate->ip == ip) {
+            slot = candidate;
+            break;
+        }
+        double score = candidate->ip != 0 ? offender_decay(candidate, r->request_time) : 0;
+        if (slot == NULL || score < lowest) {
+            slot = candidate;
+            lowest = score;
+        }
+    }
+    double score = slot->ip == ip ? offender_decay(slot, r->request_time) : 0;
+    slot->ip = ip;
+    slot->score = score + 1;
+    slot->updated = r->request_time;
+    offender_unlock(bucket);
+    if (scoreboard != NULL)
+        scoreboard->offenderBlocks.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * Hot rule reload.
+ * The CheckRule and BasicRule lines of a RulesFile are compiled along with
+ * the ones of its location. Each child watches these files and, when one
+ * changes, compiles the new rules off the request path then swaps them in;
+ * scans already running keep the snapshot they started with.
+ */
+static apr_interval_time_t rules_reload_interval = apr_time_from_sec(5);
+static std::vector<dir_config_t *> reload_cfgs;
+
+typedef struct {
+    std::atomic<bool> stop;
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    apr_thread_t *thread;
+    server_rec *server;
+} rules_watcher_t;
+
+static apr_time_t rules_file_mtime(const char *path) {
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    return apr_time_from_sec(st.st_mtim.tv_sec) + st.st_mtim.tv_nsec / 1000;
+}
+
+/* Next word of a directive line, quotes handled like ap_getword_conf() */
+static std::string rules_file_word(const std::string &line, size_t &pos) {
+    while (pos < line.size() && apr_isspace(line[pos]))
+        pos++;
+    std::string word;
+    if (pos < line.size() && (line[pos] == '"' || line[pos] == '\'')) {
+        char quote = line[pos++];
+        while (pos < line.size() && line[pos] != quote) {
+            if (line[pos] == '\\' && pos + 1 < line.size() && line[pos + 1] == quote)
+                pos++;
+            word += line[pos++];
+        }
+        pos++;
+    } else {
+        while (pos < line.size() && !apr_isspace(line[pos]))
+            word += line[pos++];
+    }
+    return word;
+}
+
+/* Appends the CheckRule and BasicRule directives of a RulesFile */
+static bool load_rules_file(const char *path, std::vector<std::pair<std::string, std::string>> &checkRules,
+                            std::vector<std::string> &basicRules, apr_time_t &mtime, std::string &err) {
+    mtime = rules_file_mtime(path);
+    std::ifstream in(path);
+    if (!in) {
+        err = std::string("cannot open ") + path;
+        return false;
+    }
+    std::string line, pending;
+    unsigned int lineNumber = 0;
+    while (std::getline(in, line)) {
+        lineNumber++;
+        size_t last = line.find_last_not_of(" \t\r");
+        line.erase(last == std::string::npos ? 0 : last + 1);
+        if (!line.empty() && line.back() == '\\') {
+            line.pop_back();
+            pending += line;
+            continue;
+        }
+        line = pending + line;
+        pending.clear();
+
+        size_t pos = 0;
+        std::string directive = rules_file_word(line, pos);
+        if (directive.empty() || directive[0] == '#')
+            continue;
+        while (pos < line.size() && apr_isspace(line[pos]))
+            pos++;
+        // Directive names are case insensitive, as in the Apache configuration
+        if (!strcasecmp(directive.c_str(), "BasicRule")) {
+            basicRules.push_back(line.substr(pos));
+        } else if (!strcasecmp(directive.c_str(), "CheckRule")) {
+            std::string score = rules_file_word(line, pos);
+            std::string action = rules_file_word(line, pos);
+            checkRules.push_back(std::make_pair(score, action));
+        } else {
+            err += path + std::string(":") + std::to_string(lineNumber) + " unsupported directive " + directive + " ";
+        }
+    }
+    return true;
+}
+
+static RuleParser *compile_rules(std::vector<std::pair<std::string, std::string>> &checkRules,
+                                 std::vector<std::string> &basicRules, unsigned int &basicRuleCount,
+                                 std::string &checkruleErr, std::string &basicruleErr) {
+    RuleParser *parser = new RuleParser();
+    parser->parseCheckRule(checkRules, checkruleErr);
+    basicRuleCount = parser->parseBasicRules(basicRules, basicruleErr);
+    parser->generateHashTables();
+    return parser;
+}
+
+static apr_status_t defender_delete_rule_snapshot(void *inPtr) {
+    delete (std::shared_ptr<rule_snapshot_t> *) inPtr;
+    return APR_SUCCESS;
+}
+
+static apr_status_t defender_release_rule_snapshot(void *inPtr) {
+    ((std::shared_ptr<rule_snapshot_t> *) inPtr)->~shared_ptr();
+    return APR_SUCCESS;
+}
+
+/* Compiles the new content of a RulesFile, the current rules are kept if it does not parse */
+static void rules_reload(dir_config_t *dcfg, server_rec *s) {
+    apr_time_t mtime = rules_file_mtime(dcfg->rules_file);
+    if (mtime == 0 || mtime == dcfg->rules_checked)
+        return;
+    dcfg->rules_checked = mtime;
+
+    std::vector<std::pair<std::string, std::string>> checkRules = dcfg->tmpCheckRules;
+    std::vector<std::string> basicRules = dcfg->tmpBasicRules;
+    std::string rulesFileErr, checkruleErr, basicruleErr;
+    unsigned int basicRuleCount;
+    if (!load_rules_file(dcfg->rules_file, checkRules, basicRules, mtime, rulesFileErr)) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Defender reload on loc %s: %s", dcfg->loc_path,
+                     rulesFileErr.c_str());
+        return;
+    }
+    std::shared_ptr<RuleParser> parser(compile_rules(checkRules, basicRules, basicRuleCount, checkruleErr,
+                                                     basicruleErr));
+    if (!rulesFileErr.empty() || !checkruleErr.empty() || !basicruleErr.empty()) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Defender reload on loc %s failed, keeping the current rules: %s%s%s",
+                     dcfg->loc_path, rulesFileErr.c_str(), checkruleErr.c_str(), basicruleErr.c_str());
+        return;
+    }
+
+    std::shared_ptr<rule_snapshot_t> snapshot = std::make_shared<rule_snapshot_t>();
+    snapshot->parser = parser;
+    snapshot->mtime = mtime;
+    std::atomic_store(dcfg->rules, snapshot);
+    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                 "Defender reloaded rules of loc %s: %lu CheckRules loaded, %d BasicRules loaded",
+                 dcfg->loc_path, parser->checkRules.size(), basicRuleCount);
+}
+
+static void *APR_THREAD_FUNC rules_watcher_run(apr_thread_t *thread, void *data) {
+    rules_watcher_t *watcher = (rules_watcher_t *) data;
+    while (!watcher->stop.load()) {
+        apr_thread_mutex_lock(watcher->mutex);
+        if (!watcher->stop.load())
+            apr_thread_cond_timedwait(watcher->cond, watcher->mutex, rules_reload_interval);
+        apr_thread_mutex_unlock(watcher->mutex);
+        for (size_t i = 0; i < reload_cfgs.size() && !watcher->stop.load(); i++)
+            rules_reload(reload_cfgs[i], watcher->server);
+    }
+    apr_thread_exit(thread, APR_SUCCESS);
+    return NULL;
+}
+
+static apr_status_t rules_watcher_destroy(void *data) {
+    rules_watcher_t *watcher = (rules_watcher_t *) data;
+    apr_thread_mutex_lock(watcher->mutex);
+    watcher->stop.store(true);
+    apr_thread_cond_signal(watcher->cond);
+    apr_thread_mutex_unlock(watcher->mutex);
+    apr_status_t rv;
+    apr_thread_join(&rv, watcher->thread);
+    watcher->~rules_watcher_t();
+    return APR_SUCCESS;
+}
+
+static void rules_watcher_create(apr_pool_t *p, server_rec *s) {
+    rules_watcher_t *watcher = new(apr_palloc(p, sizeof(rules_watcher_t))) rules_watcher_t();
+    watcher->stop.store(false);
+    watcher->server = s;
+    apr_status_t rv = apr_thread_mutex_create(&watcher->mutex, APR_THREAD_MUTEX_DEFAULT, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_cond_create(&watcher->cond, p);
+    if (rv == APR_SUCCESS)
+        rv = apr_thread_create(&watcher->thread, NULL, rules_watcher_run, watcher, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Defender: failed to start the rules watcher thread, "
+                "RulesFile changes need a restart");
+        watcher->~rules_watcher_t();
+        return;
+    }
+    apr_pool_cleanup_register(p, watcher, rules_watcher_destroy, apr_pool_cleanup_null);
+}
+
+/*
+ * Parallel body scan.
+ * A large urlencoded body is cut at '&' into segments that silent scanners
+ * check on a per-child thread pool. The request thread does not wait behind
+ * the tasks of other requests: it scans the segments no pool thread has
+ * started yet. When no segment matches anything the body is clean as a
+ * whole, as every argument is scanned on its own. Otherwise, or when the
+ * headers or the query string already matched, the body is scanned again
+ * the usual way, so verdicts and logs are those of the serial scan.
+ */
+typedef struct {
+    unsigned int threads; // per child, 0 scans every body on the request thread
+    apr_size_t minBody;
+} body_scan_config_t;
+
+static const body_scan_config_t default_body_scan_cfg = {0, 1048576};
+static body_scan_config_t body_scan_cfg = default_body_scan_cfg;
+
+#define BODY_SEGMENT_MIN 65536
+
+#if APR_HAS_THREADS
+static apr_thread_pool_t *body_scan_pool;
+
+typedef struct {
+    apr_thread_mutex_t *mutex;
+    apr_thread_cond_t *cond;
+    unsigned int pending; // segments being scanned by pool threads
+} body_scan_batch_t;
+
+typedef struct {
+    request_rec *r;
+    RuleParser *parser;
+    const RuntimeScanner *scanner; // of the request, read only
+    const char *data;
+    size_t len;
+    bool claimed; // by the request thread or a pool thread, under the batch mutex
+    bool matched;
+    body_scan_batch_t *batch;
+} body_segment_t;
+
+static int body_segment_log(void *, const void *, size_t *) {
+    return APR_SUCCESS;
+}
+
+/* False if the segment has already been taken by another thread */
+static bool body_segment_claim(body_segment_t *segment, bool pool) {
+    body_scan_batch_t *batch = segment->batch;
+    apr_thread_mutex_lock(batch->mutex);
+    bool claimed = !segment->claimed;
+    segment->claimed = true;
+    if (claimed && pool)
+        batch->pending++;
+    apr_thread_mutex_unlock(batch->mutex);
+    return claimed;
+}
+
+/* Anything going wrong counts as a match, the body is then scanned serially */
+static void body_segment_scan(body_segment_t *segment) {
+    segment->matched = true;
+    try {
+        const RuntimeScanner *main = segment->scanner;
+        RuntimeScanner scanner(*segment->parser);
+        scanner.method = main->method;
+        scanner.writeLogFn = body_segment_log;
+        scanner.learning = main->learning;
+        scanner.libinjSQL = main->libinjSQL;
+        scanner.libinjXSS = main->libinjXSS;
+        scanner.bodyLimit = main->bodyLimit;
+        scanner.setUri(segment->r->parsed_uri.path);
+        const apr_array_header_t *headerFields = apr_table_elts(segment->r->headers_in);
+        apr_table_entry_t *headerEntry = (apr_table_entry_t *) headerFields->elts;
+        for (int i = 0; i < headerFields->nelts; i++)
+            scanner.addHeader(headerEntry[i].key, headerEntry[i].val);
+        scanner.processHeaders();
+        if (scanner.block || scanner.drop)
+            return;
+        auto headerScores = scanner.matchScores;
+        scanner.contentLengthProvided = true;
+        scanner.contentLength = segment->len;
+        scanner.body.assign(segment->data, segment->len);
+        scanner.processBody();
+        segment->matched = scanner.block || scanner.drop || scanner.matchScores != headerScores;
+    } catch (...) {
+    }
+}
+
+static void *APR_THREAD_FUNC body_segment_task(apr_thread_t *, void *data) {
+    body_segment_t *segment = (body_segment_t *) data;
+    if (!body_segment_claim(segment, true))
+        return NULL;
+    body_segment_scan(segment);
+    body_scan_batch_t *batch = segment->batch;
+    apr_thread_mutex_lock(batch->mutex);
+    if (--batch->pending == 0)
+        apr_thread_cond_signal(batch->cond);
+    apr_thread_mutex_unlock(batch->mutex);
+    return NULL;
+}
+
+/* True if the segments of the body have been scanned in parallel without any match */
+static bool body_scan_parallel(request_rec *r, RuleParser *parser, RuntimeScanner *scanner) {
+    const std::string &body = scanner->body;
+    const char *contentType = apr_table_get(r->headers_in, "Content-Type");
+    if (body_scan_pool == NULL || body.size() < body_scan_cfg.minBody || contentType == NULL ||
+        strncasecmp(contentType, "application/x-www-form-urlencoded", 33) != 0)
+        return false;
+    // processBody() still has to evaluate and log what the headers or the query string matched
+    if (!scanner->matchScores.empty() || scanner->block || scanner->drop)
+        return false;
+
+    size_t count = std::min<size_t>(body_scan_cfg.threads + 1, body.size() / BODY_SEGMENT_MIN);
+    if (count < 2)
+        return false;
+    body_segment_t *segments = (body_segment_t *) apr_pcalloc(r->pool, count * sizeof(body_segment_t));
+    size_t start = 0, used = 0;
+    for (size_t i = 0; i < count && start < body.size(); i++) {
+        size_t end = body.size();
+        if (i + 1 < count) {
+            end = body.find('&', std::max(start, body.size() * (i + 1) / count));
+            if (end == std::string::npos)
+                end = body.size();
+        }
+        segments[used].r = r;
+        segments[used].parser = parser;
+        segments[used].scanner = scanner;
+        segments[used].data = body.data() + start;
+        segments[used].len = end - start;
+        used++;
+        start = end + 1;
+    }
+    if (used < 2)
+        return false;
+
+    body_scan_batch_t batch;
+    batch.pending = 0;
+    if (apr_thread_mutex_create(&batch.mutex, APR_THREAD_MUTEX_DEFAULT, r->pool) != APR_SUCCESS ||
+        apr_thread_cond_create(&batch.cond, r->pool) != APR_SUCCESS)
+        return false;
+    for (size_t i = 0; i < used; i++)
+        segments[i].batch = &batch;
+    // A segment whose task could not be queued is scanned below like any other not started
+    for (size_t i = 1; i < used; i++)
+        apr_thread_pool_push(body_scan_pool, body_segment_task, &segments[i], APR_THREAD_TASK_PRIORITY_NORMAL, &batch);
+    for (size_t i = 0; i < used; i++) {
+        if (body_segment_claim(&segments[i], false))
+            body_segment_scan(&segments[i]);
+    }
+    apr_thread_mutex_lock(batch.mutex);
+    while (batch.pending > 0)
+        apr_thread_cond_wait(batch.cond, batch.mutex);
+    apr_thread_mutex_unlock(batch.mutex);
+    // Tasks still queued have nothing left to scan but point into this request
+    apr_thread_pool_tasks_cancel(body_scan_pool, &batch);
+
+    for (size_t i = 0; i < used; i++) {
+        if (segments[i].matched)
+            return false;
+    }
+    return true;
+}
+
+static void body_scan_pool_create(apr_pool_t *p, server_rec *s) {
+    apr_status_t rv = apr_thread_pool_create(&body_scan_pool, 0, body_scan_cfg.threads, p);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s, "Defender: failed to create the body scan threads, "
+                "bodies are scanned on the request thread");
+        body_scan_pool = NULL;
+    }
+}
+#endif
+
+static int process_body(request_rec *r, RuleParser *parser, RuntimeScanner *scanner) {
+    uint64_t start = stats_clock();
+    int ret;
+#if APR_HAS_THREADS
+    if (body_scan_parallel(r, parser, scanner))
+        ret = DECLINED;
+    else
+#endif
+        ret = scanner->processBody();
+    stats_phase(PHASE_PROCESS_BODY, start);
+    return ret;
+}
+
+/*
+ * Scan bypass.
+ * The BypassPrefix and BypassExtension of a location are compiled into one
+ * trie, prefixes from its first root and reversed extensions from its
+ * second, so that a request is checked with a single walk over each end of
+ * its path before anything is allocated for it.
+ */
+typedef struct {
+    std::vector<std::pair<unsigned char, unsigned int>> edges;
+    bool terminal;
+} bypass_node_t;
+
+#define BYPASS_PREFIX_ROOT 0
+#define BYPASS_EXTENSION_ROOT 1
+
+struct bypass_t {
+    std::vector<bypass_node_t> nodes;
+};
+
+/* Child of node through c, 0 if none (a root is never a child) */
+static inline unsigned int bypass_child(const bypass_t *bypass, unsigned int node, unsigned char c) {
+    for (const auto &edge : bypass->nodes[node].edges) {
+        if (edge.first == c)
+            return edge.second;
+    }
+    return 0;
+}
+
+static void bypass_insert(bypass_t *bypass, unsigned int node, const std::string &word) {
+    for (unsigned char c : word) {
+        unsigned int child = bypass_child(bypass, node, c);
+        if (child == 0) {
+            child = (unsigned int) bypass->nodes.size();
+            bypass->nodes[node].edges.push_back(std::make_pair(c, child));
+            bypass->nodes.push_back(bypass_node_t());
+        }
+        node = child;
+    }
+    bypass->nodes[node].terminal = true;
+}
+
+static apr_status_t defender_delete_bypass(void *inPtr) {
+    delete (bypass_t *) inPtr;
+    return APR_SUCCESS;
+}
+
+static void bypass_compile(apr_pool_t *pconf, dir_config_t *dcfg) {
+    dcfg->bypass = NULL;
+    if (dcfg->bypassPrefixes.empty() && dcfg->bypassExtensions.empty())
+        return;
+    bypass_t *bypass = new bypass_t();
+    bypass->nodes.resize(2);
+    for (const auto &prefix : dcfg->bypassPrefixes)
+        bypass_insert(bypass, BYPASS_PREFIX_ROOT, prefix);
+    for (const auto &extension : dcfg->bypassExtensions)
+        bypass_insert(bypass, BYPASS_EXTENSION_ROOT, std::string(extension.rbegin(), extension.rend()));
+    apr_pool_cleanup_register(pconf, (void *) bypass, defender_delete_bypass, apr_pool_cleanup_null);
+    dcfg->bypass = bypass;
+}
+
+/*
+ * Prefixes are matched on the whole path, extensions case insensitively on
+ * the last segment before extEnd only.
+ */
+static bool bypass_match(const bypass_t *bypass, const char *path, const char *extEnd) {
+    unsigned int node = BYPASS_PREFIX_ROOT;
+    for (const char *p = path; *p; p++) {
+        node = bypass_child(bypass, node, (unsigned char) *p);
+        if (node == 0)
+            break;
+        if (bypass->nodes[node].terminal)
+            return true;
+    }
+    node = BYPASS_EXTENSION_ROOT;
+    for (const char *p = extEnd; p > path && *--p != '/';) {
+        node = bypass_child(bypass, node, (unsigned char) apr_tolower(*p));
+        if (node == 0)
+            break;
+        if (bypass->nodes[node].terminal)
+            return true;
+    }
+    return false;
+}
+
+/* Uniform in [0, 1), from a per-thread xorshift64* generator */
+static inline double sample_random() {
+    static thread_local uint64_t state;
+    if (state == 0)
+        state = (stats_clock() ^ (uint64_t) (uintptr_t) &state ^ (uint64_t) child_pid << 32) | 1;
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return ((state * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
 
-/* Custom definition to hold any configuration data we may need. */
-typedef struct {
-    RuntimeScanner *vpRuntimeScanner;
-} defender_config_t;
+/* True if the request is let through without a scan */
+static bool bypass_request(request_rec *r, const dir_config_t *dcfg) {
+    // Methods registered at runtime may be numbered beyond the mask
+    if (r->method_number < 64 && (dcfg->bypass_methods & (AP_METHOD_BIT << r->method_number)))
+        return true;
+    // r->uri is decoded and free of "." and ".." segments, "/static/../admin" does not bypass
+    if (dcfg->bypass != NULL && r->uri != NULL) {
+        // The extension is the one of the resource, not of its PATH_INFO: /index.php/x.css is scanned
+        const char *extEnd = r->uri + strlen(r->uri);
+        if (r->path_info != NULL) {
+            size_t pathInfo = strlen(r->path_info);
+            if (pathInfo <= (size_t) (extEnd - r->uri) && strcmp(extEnd - pathInfo, r->path_info) == 0)
+                extEnd -= pathInfo;
+        }
+        if (bypass_match(dcfg->bypass, r->uri, extEnd))
+            return true;
+    }
+    return dcfg->learning_sample > 0 && dcfg->learning && sample_random() >= dcfg->learning_sample;
+}
 
-/* Custom function to ensure our RuntimeScanner get's deleted at the
-   end of the request cycle. */
-static apr_status_t defender_delete_runtimescanner_object(void *inPtr) {
-    if (inPtr)
-        delete (RuntimeScanner *) inPtr;
+/*
+ * This routine is called before the configuration is read, process-wide
+ * settings are reset so that a directive removed on restart is not kept.
+ */
+static int pre_config(apr_pool_t *, apr_pool_t *, apr_pool_t *) {
+    log_cfg = default_log_cfg;
+    rules_reload_interval = apr_time_from_sec(5);
+    verdict_cache_size = 16384;
+    verdict_cache_ttl = apr_time_from_sec(60);
+    offender_cfg = default_offender_cfg;
+    learning_agg_cfg = default_learning_agg_cfg;
+    body_scan_cfg = default_body_scan_cfg;
     return OK;
 }
 
-static apr_status_t defender_delete_ruleparser_object(void *inPtr) {
-    if (inPtr) {
-        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, NULL, "Unloading Defender for a loc");
-        delete (RuleParser *) inPtr;
+/*
+ * Identity of the rules a location compiles, locations with equal keys
+ * end up with the same RuleParser.
+ */
+static std::string rule_set_key(const std::vector<std::pair<std::string, std::string>> &checkRules,
+                                const std::vector<std::string> &basicRules) {
+    std::string key;
+    for (const auto &checkRule : checkRules) {
+        key += checkRule.first;
+        key += '\x1f';
+        key += checkRule.second;
+        key += '\x1e';
     }
-    return OK;
+    key += '\x1d';
+    for (const auto &basicRule : basicRules) {
+        key += basicRule;
+        key += '\x1e';
+    }
+    return key;
 }
 
 /*
@@ -87,35 +1632,124 @@ static int post_config(apr_pool_t *pconf, apr_pool_t *, apr_pool_t *, server_rec
         if (!mainruleErr.empty())
             ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "MainRules error %s", mainruleErr.c_str());
 
+        // Locations with the very same CheckRules and BasicRules share one read-only RuleParser
+        std::unordered_map<std::string, RuleParser *> ruleSets;
+        std::unordered_map<std::string, std::string> ruleSetErrs;
+        scoreboard_locs.clear();
+        reload_cfgs.clear();
+        bool verdictCache = false;
+        bool offenderTracking = false;
+        learning_agg_used = false;
         for (int i = 0; i < dir_cfgs.size(); i++) {
             dir_config_t *dcfg = dir_cfgs[i];
             if (dcfg->defender) {
-                dcfg->parser = new RuleParser();
-                apr_pool_cleanup_register(pconf, (void *) dcfg->parser, defender_delete_ruleparser_object,
-                                          apr_pool_cleanup_null);
-                std::string checkruleErr;
-                dcfg->parser->parseCheckRule(dcfg->tmpCheckRules, checkruleErr);
-                std::string basicruleErr;
-                unsigned int basicRuleCount = dcfg->parser->parseBasicRules(dcfg->tmpBasicRules, basicruleErr);
-                ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
-                             "Defender active%s on loc %s: %lu CheckRules loaded, %d BasicRules loaded",
-                             (dcfg->learning ? " (learning)" : ""), dcfg->loc_path, dcfg->parser->checkRules.size(),
-                             basicRuleCount);
-                if (!checkruleErr.empty())
-                    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "CheckRule parsing error %s", checkruleErr.c_str());
-                if (!basicruleErr.empty())
-                    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "BasicRule parsing error %s", basicruleErr.c_str());
-                dcfg->parser->generateHashTables();
+                scoreboard_locs.push_back(dcfg->loc_path);
+                dcfg->stats_slot = (unsigned int) scoreboard_locs.size();
+                bypass_compile(pconf, dcfg);
+                verdictCache = verdictCache || dcfg->verdict_cache;
+                offenderTracking = offenderTracking || dcfg->offender_tracking;
+                if (dcfg->learning_aggregate && !dcfg->learning)
+                    ap_log_error(APLOG_MARK, APLOG_WARNING, 0, s, "LearningAggregate ignored on loc %s without "
+                            "LearningMode On", dcfg->loc_path);
+                dcfg->learning_aggregate = dcfg->learning_aggregate && dcfg->learning;
+                learning_agg_used = learning_agg_used || dcfg->learning_aggregate;
+
+                std::vector<std::pair<std::string, std::string>> checkRules = dcfg->tmpCheckRules;
+                std::vector<std::string> basicRules = dcfg->tmpBasicRules;
+                apr_time_t rulesMtime = 0;
+                std::string rulesFileErr;
+                if (dcfg->rules_file != NULL)
+                    load_rules_file(dcfg->rules_file, checkRules, basicRules, rulesMtime, rulesFileErr);
+
+                std::string ruleSetKey = rule_set_key(checkRules, basicRules);
+                auto ruleSet = ruleSets.find(ruleSetKey);
+                if (ruleSet != ruleSets.end()) {
+                    dcfg->parser = ruleSet->second;
+                    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                                 "Defender active%s on loc %s: %lu CheckRules, %lu BasicRules shared with a previous loc",
+                                 (dcfg->learning ? " (learning)" : ""), dcfg->loc_path,
+                                 dcfg->parser->checkRules.size(), basicRules.size());
+                } else {
+                    std::string checkruleErr;
+                    std::string basicruleErr;
+                    unsigned int basicRuleCount;
+                    dcfg->parser = compile_rules(checkRules, basicRules, basicRuleCount, checkruleErr, basicruleErr);
+                    apr_pool_cleanup_register(pconf, (void *) dcfg->parser, defender_delete_ruleparser_object,
+                                              apr_pool_cleanup_null);
+                    ruleSets[ruleSetKey] = dcfg->parser;
+                    ruleSetErrs[ruleSetKey] = checkruleErr + basicruleErr;
+                    ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s,
+                                 "Defender active%s on loc %s: %lu CheckRules loaded, %d BasicRules loaded",
+                                 (dcfg->learning ? " (learning)" : ""), dcfg->loc_path,
+                                 dcfg->parser->checkRules.size(), basicRuleCount);
+                    if (!checkruleErr.empty())
+                        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "CheckRule parsing error %s",
+                                     checkruleErr.c_str());
+                    if (!basicruleErr.empty())
+                        ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "BasicRule parsing error %s",
+                                     basicruleErr.c_str());
+                }
+
+                // A reload would reject these rules, do not run the loc without them
+                if (dcfg->rules_file != NULL && (!rulesFileErr.empty() || !ruleSetErrs[ruleSetKey].empty())) {
+                    ap_log_error(APLOG_MARK, APLOG_ERR, 0, s, "Defender on loc %s: RulesFile %s rejected: %s%s",
+                                 dcfg->loc_path, dcfg->rules_file, rulesFileErr.c_str(),
+                                 ruleSetErrs[ruleSetKey].c_str());
+                    dir_cfgs.clear();
+                    return HTTP_INTERNAL_SERVER_ERROR;
+                }
+
+                // The parser compiled here stays owned by pconf, reloads bring their own
+                if (dcfg->rules_file != NULL) {
+                    std::shared_ptr<rule_snapshot_t> snapshot = std::make_shared<rule_snapshot_t>();
+                    snapshot->parser = std::shared_ptr<RuleParser>(dcfg->parser, [](RuleParser *) {});
+                    snapshot->mtime = rulesMtime;
+                    dcfg->rules_checked = rulesMtime;
+                    dcfg->rules = new std::shared_ptr<rule_snapshot_t>(snapshot);
+                    apr_pool_cleanup_register(pconf, (void *) dcfg->rules, defender_delete_rule_snapshot,
+                                              apr_pool_cleanup_null);
+                    reload_cfgs.push_back(dcfg);
+                }
             } else {
                 ap_log_error(APLOG_MARK, APLOG_NOTICE, 0, s, "Defender scanner disabled for loc %s",
                              dcfg->loc_path);
             }
         }
+        scoreboard_create(pconf, s);
+        verdict_cache = NULL;
+        if (verdictCache && verdict_cache_size > 0)
+            verdict_cache_create(pconf, s);
+        offender_table = NULL;
+        if (offenderTracking && offender_cfg.size > 0)
+            offender_table_create(pconf, s);
     }
     dir_cfgs.clear();
     return OK;
 }
 
+/*
+ * This routine is called once in every child process right after it has
+ * been forked, before any request is served.
+ */
+static void child_init(apr_pool_t *pchild, server_rec *s) {
+    child_pid = getpid();
+#if APR_HAS_THREADS
+    if (log_cfg.buffer > 0)
+        log_ring_create(pchild, s);
+    // Created after the ring so that its last flush still goes through it
+    if (learning_agg_used)
+        learning_agg_create(pchild, s);
+    if (body_scan_cfg.threads > 0)
+        body_scan_pool_create(pchild, s);
+    if (!reload_cfgs.empty() && rules_reload_interval > 0)
+        rules_watcher_create(pchild, s);
+#endif
+    ap_version_t vers;
+    ap_get_server_revision(&vers);
+    software_version = std::to_string(vers.major) + "." + std::to_string(vers.minor) + "." +
+                       std::to_string(vers.patch);
+}
+
 static int pass_in_env(request_rec *r, RuntimeScanner *scanner) {
     if ((scanner->block && !scanner->learning) || scanner->drop)
         apr_table_set(r->subprocess_env, "defender_action", "block");
@@ -126,10 +1760,6 @@ static int pass_in_env(request_rec *r, RuntimeScanner *scanner) {
     return DECLINED;
 }
 
-static int write_log(void *thefile, const void *buf, size_t *nbytes) {
-    return apr_file_write((apr_file_t *) thefile, buf, nbytes);
-}
-
 /*
  * this routine gives our module another chance to examine the request
  * headers and to take special action. This is the first phase whose
@@ -148,7 +1778,65 @@ static int header_parser(request_rec *r) {
     if (!dcfg->defender)
         return DECLINED;
 
-    RuntimeScanner *scanner = new RuntimeScanner(*dcfg->parser);
+    // Let accepted static assets, health checks and unsampled learning requests through untouched
+    if (bypass_request(r, dcfg)) {
+        loc_counter_t *loc = stats_loc(dcfg);
+        if (loc != NULL)
+            loc->bypassed.fetch_add(1, std::memory_order_relaxed);
+        return DECLINED;
+    }
+
+    uint64_t start = stats_clock();
+    log_loc = dcfg;
+
+    // Reject clients that have been blocked too often lately, learning locations never block
+    bool offenderTracked = dcfg->offender_tracking && offender_table != NULL && !dcfg->learning && !offender_allowed(r);
+    if (offenderTracked) {
+        double score = offender_score(r);
+        if (score >= offender_cfg.threshold) {
+            ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Defender: rejecting offender %s (score %.1f)",
+                          r->useragent_ip, score);
+            if (offender_cfg.tarpit > 0)
+                apr_sleep(offender_cfg.tarpit);
+            if (scoreboard != NULL)
+                scoreboard->offenderRejected.fetch_add(1, std::memory_order_relaxed);
+            int ret = HTTP_FORBIDDEN;
+            if (dcfg->useenv) {
+                apr_table_set(r->subprocess_env, "defender_action", "block");
+                ret = DECLINED;
+            }
+            stats_phase(PHASE_HEADER_PARSER, start);
+            stats_request(dcfg, start, ret, true);
+            return ret;
+        }
+    }
+
+    // Hold the current rules until the end of the request, a reload may swap them meanwhile
+    RuleParser *parser = dcfg->parser;
+    apr_time_t rulesMtime = 0;
+    if (dcfg->rules != NULL) {
+        void *rulesMem = apr_palloc(r->pool, sizeof(std::shared_ptr<rule_snapshot_t>));
+        std::shared_ptr<rule_snapshot_t> *rules = new(rulesMem) std::shared_ptr<rule_snapshot_t>(
+                std::atomic_load(dcfg->rules));
+        apr_pool_cleanup_register(r->pool, (void *) rules, defender_release_rule_snapshot, apr_pool_cleanup_null);
+        parser = (*rules)->parser.get();
+        rulesMtime = (*rules)->mtime;
+    }
+
+    // Skip GET requests already found clean, unless debug logs are expected from the scan
+    uint64_t verdictKey = 0;
+    if (dcfg->verdict_cache && verdict_cache != NULL && r->method_number == M_GET && r->log->level < APLOG_DEBUG) {
+        verdictKey = verdict_cache_key(r, dcfg, rulesMtime);
+        if (verdict_cache_lookup(verdictKey, r->request_time)) {
+            stats_phase(PHASE_HEADER_PARSER, start);
+            stats_request(dcfg, start, DECLINED, true);
+            return DECLINED;
+        }
+    }
+
+    // Construct the scanner in the request pool rather than on the heap
+    void *scannerMem = apr_palloc(r->pool, sizeof(RuntimeScanner));
+    RuntimeScanner *scanner = new(scannerMem) RuntimeScanner(*parser);
 
     // Register a C function to delete scanner at the end of the request cycle
     apr_pool_cleanup_register(r->pool, (void *) scanner, defender_delete_runtimescanner_object,
@@ -159,6 +1847,8 @@ static int header_parser(request_rec *r) {
 
     // Remember our application pointer for future calls
     pDefenderConfig->vpRuntimeScanner = scanner;
+    pDefenderConfig->parser = parser;
+    pDefenderConfig->offenderRecorded = false;
 
     // Register our config data structure for our module for retrieval later as required
     ap_set_module_config(r->request_config, &defender_module, (void *) pDefenderConfig);
@@ -172,22 +1862,21 @@ static int header_parser(request_rec *r) {
         scanner->method = METHOD_PUT;
 
     // Set logger info
-    scanner->pid = getpid();
-    apr_os_thread_t tid = apr_os_thread_current();
-    unsigned int pid_buffer_len = 16;
-    char pid_buffer[pid_buffer_len];
-    apr_snprintf(pid_buffer, pid_buffer_len, "%pT", &tid);
-    scanner->threadId = std::string(pid_buffer);
+    scanner->pid = child_pid;
+    if (thread_id.empty()) {
+        apr_os_thread_t tid = apr_os_thread_current();
+        char tid_buffer[16];
+        apr_snprintf(tid_buffer, sizeof(tid_buffer), "%pT", &tid);
+        thread_id = tid_buffer;
+    }
+    scanner->threadId = thread_id;
     scanner->connectionId = r->connection->id;
     scanner->clientIp = r->useragent_ip;
     scanner->requestedHost = r->hostname;
     scanner->serverHostname = r->server->server_hostname;
     scanner->fullUri = r->unparsed_uri;
     scanner->protocol = r->protocol;
-    ap_version_t vers;
-    ap_get_server_revision(&vers);
-    scanner->softwareVersion = std::to_string(vers.major) + "." + std::to_string(vers.minor) + "." +
-                               std::to_string(vers.patch);
+    scanner->softwareVersion = software_version;
     scanner->logLevel = static_cast<LOG_LVL>(r->log->level);
     if (scanner->logLevel >= APLOG_DEBUG)
         scanner->logLevel = LOG_LVL_DEBUG;
@@ -212,20 +1901,41 @@ static int header_parser(request_rec *r) {
     for (int i = 0; i < headerFields->nelts; i++)
         scanner->addHeader(headerEntry[i].key, headerEntry[i].val);
 
-    // Pass GET parameters
-    apr_table_t *getTable = NULL;
-    ap_args_to_table(r, &getTable);
-    const apr_array_header_t *getParams = apr_table_elts(getTable);
-    apr_table_entry_t *getParam = (apr_table_entry_t *) getParams->elts;
-    for (int i = 0; i < getParams->nelts; i++)
-        scanner->addGETParameter(getParam[i].key, getParam[i].val);
+    // Pass GET parameters, split and decoded in place within a single copy of the query string
+    if (r->args != NULL) {
+        char *args = apr_pstrdup(r->pool, r->args);
+        char *state;
+        for (char *key = apr_strtok(args, "&", &state); key != NULL; key = apr_strtok(NULL, "&", &state)) {
+            char *val = strchr(key, '=');
+            if (val != NULL) {
+                *val++ = '\0';
+                url_decode(val);
+            } else {
+                val = (char *) "1";
+            }
+            url_decode(key);
+            scanner->addGETParameter(key, val);
+        }
+    }
 
     // Run scanner
+    uint64_t scanStart = stats_clock();
     int ret = scanner->processHeaders();
+    stats_phase(PHASE_PROCESS_HEADERS, scanStart);
+
+    if (verdictKey != 0 && ret == DECLINED && !scanner->block && !scanner->drop && scanner->matchScores.empty())
+        verdict_cache_store(verdictKey, r->request_time);
+
+    if (offenderTracked && ((scanner->block && !scanner->learning) || scanner->drop)) {
+        offender_record(r);
+        pDefenderConfig->offenderRecorded = true;
+    }
 
     if (dcfg->useenv)
         ret = pass_in_env(r, scanner);
 
+    stats_phase(PHASE_HEADER_PARSER, start);
+    stats_request(dcfg, start, ret, true);
     return ret;
 }
 
@@ -237,17 +1947,362 @@ static char *get_apr_error(apr_pool_t *p, apr_status_t rc) {
 }
 
 /*
- * This routine is called to perform any module-specific fixing of header
- * fields, et cetera.  It is invoked just before any content-handler.
- *
- * This is a RUN_ALL HOOK.
+ * Input filter handing the body read by fixups back to the handler.
+ * Once every set aside bucket has been consumed, it removes itself and
+ * lets the rest of the input chain (e.g. the part of the body above
+ * RequestBodyLimit) flow through untouched.
  */
-static int fixups(request_rec *r) {
+static apr_status_t defender_in_filter(ap_filter_t *f, apr_bucket_brigade *bb, ap_input_mode_t mode,
+                                       apr_read_type_e block, apr_off_t readbytes) {
+    apr_bucket_brigade *body = (apr_bucket_brigade *) f->ctx;
+
+    if (body == NULL || APR_BRIGADE_EMPTY(body)) {
+        ap_remove_input_filter(f);
+        return ap_get_brigade(f->next, bb, mode, block, readbytes);
+    }
+
+    switch (mode) {
+        case AP_MODE_READBYTES:
+        case AP_MODE_SPECULATIVE: {
+            apr_bucket *end;
+            apr_status_t rv = apr_brigade_partition(body, readbytes, &end);
+            if (rv != APR_SUCCESS && rv != APR_INCOMPLETE)
+                return rv;
+            if (mode == AP_MODE_SPECULATIVE) {
+                for (apr_bucket *bucket = APR_BRIGADE_FIRST(body); bucket != end; bucket = APR_BUCKET_NEXT(bucket)) {
+                    apr_bucket *copy;
+                    rv = apr_bucket_copy(bucket, &copy);
+                    if (rv != APR_SUCCESS)
+                        return rv;
+                    APR_BRIGADE_INSERT_TAIL(bb, copy);
+                }
+                return APR_SUCCESS;
+            }
+            while (APR_BRIGADE_FIRST(body) != end) {
+                apr_bucket *bucket = APR_BRIGADE_FIRST(body);
+                APR_BUCKET_REMOVE(bucket);
+                APR_BRIGADE_INSERT_TAIL(bb, bucket);
+            }
+            return APR_SUCCESS;
+        }
+        case AP_MODE_GETLINE:
+            return apr_brigade_split_line(bb, body, block, HUGE_STRING_LEN);
+        case AP_MODE_EXHAUSTIVE:
+            APR_BRIGADE_CONCAT(bb, body);
+            return APR_SUCCESS;
+        default:
+            return ap_get_brigade(f->next, bb, mode, block, readbytes);
+    }
+}
+
+/*
+ * Multipart upload streaming.
+ * Copies a multipart/form-data body to the scanner while leaving out the
+ * content of file parts, hashed on the fly when UploadHash is on. Part
+ * headers (field names, filenames) and text fields are kept untouched so
+ * that the scanner still parses a well-formed body. Between two buckets only
+ * the tail which may hold the beginning of a boundary is carried over.
+ * Like PHP, a delimiter is LF "--" boundary with an optional CR before it and
+ * part headers may end with bare LFs. Backends disagree on such parts, so
+ * they are passed to the scanner with CRLFs and their content is kept.
+ */
+#define MULTIPART_HEADERS_MAX 8192
+
+enum {
+    MULTIPART_OFF, // not multipart or given up, bytes are copied as they come
+    MULTIPART_CONTENT, // preamble or content of a part
+    MULTIPART_HEADERS, // after a boundary, until the end of the part headers
+    MULTIPART_EPILOGUE // after the closing boundary
+};
+
+typedef struct {
+    int state;
+    bool file; // the current part is a file
+    bool hash;
+    bool bareLf; // the last delimiter had no CR
+    std::string delimiter; // LF "--" boundary
+    std::string pending; // bytes whose fate is not known yet
+    size_t skip; // leading bytes of pending which are not part of the body
+    apr_sha1_ctx_t sha1;
+    apr_off_t fileBytes;
+    unsigned int files;
+} multipart_stream_t;
+
+/* False if the body is not multipart/form-data with a usable boundary, it is then copied as is */
+static bool multipart_init(request_rec *r, multipart_stream_t *mp, bool hash) {
+    mp->state = MULTIPART_OFF;
+    const char *contentType = apr_table_get(r->headers_in, "Content-Type");
+    if (contentType == NULL || strncasecmp(contentType, "multipart/form-data", 19))
+        return false;
+    std::string params(contentType + 19);
+    std::transform(params.begin(), params.end(), params.begin(), ::tolower);
+    size_t pos = params.find("boundary=");
+    if (pos == std::string::npos)
+        return false;
+    // The boundary is case sensitive, take it from the original header
+    std::string boundary(contentType + 19 + pos + 9);
+    boundary = boundary.substr(0, boundary.find(';'));
+    size_t last = boundary.find_last_not_of(" \t");
+    boundary.erase(last == std::string::npos ? 0 : last + 1);
+    if (boundary.size() >= 2 && boundary.front() == '"' && boundary.back() == '"')
+        boundary = boundary.substr(1, boundary.size() - 2);
+    if (boundary.empty() || boundary.size() > 200)
+        return false;
+
+    mp->state = MULTIPART_CONTENT;
+    mp->file = false;
+    mp->hash = hash;
+    mp->bareLf = false;
+    mp->delimiter = "\n--" + boundary;
+    // The first boundary is not preceded by a LF, pretend it is
+    mp->pending = "\n";
+    mp->skip = 1;
+    mp->fileBytes = 0;
+    mp->files = 0;
+    return true;
+}
+
+/*
+ * True if the lower cased part headers have a single Content-Disposition with
+ * a filename= parameter, as PHP reads them: the rest of the boundary line is
+ * not a header, quoted strings are skipped so that name="a;filename=b" is a
+ * text field, and filename* is not a file. A repeated Content-Disposition
+ * may be read differently by the backend, the content is then kept.
+ */
+static bool multipart_is_file(const std::string &headers) {
+    static const char disposition[] = "content-disposition:";
+    unsigned int dispositions = 0;
+    bool file = false;
+    for (size_t line = headers.find("\r\n"); line != std::string::npos && line < headers.size();) {
+        line += 2;
+        size_t eol = headers.find("\r\n", line);
+        if (eol == std::string::npos)
+            eol = headers.size();
+        if (headers.compare(line, sizeof(disposition) - 1, disposition) == 0) {
+            dispositions++;
+            char quote = '\0';
+            for (size_t i = line + sizeof(disposition) - 1; i < eol; i++) {
+                char c = headers[i];
+                if (quote) {
+                    if (c == '\\' && i + 1 < eol && headers[i + 1] == quote)
+                        i++;
+                    else if (c == quote)
+                        quote = '\0';
+                    continue;
+                }
+                if (c == '"' || c == '\'') {
+                    quote = c;
+                    continue;
+                }
+                if (c != ';')
+                    continue;
+                size_t name = headers.find_first_not_of(" \t", i + 1);
+                if (name == std::string::npos || name >= eol)
+                    break;
+                file = file || (headers.compare(name, 9, "filename=") == 0 && name + 9 <= eol);
+            }
+        }
+        line = eol;
+    }
+    return dispositions == 1 && file;
+}
+
+static void multipart_emit(multipart_stream_t *mp, const char *buf, size_t len, std::string &out) {
+    size_t skip = std::min(mp->skip, len);
+    mp->skip -= skip;
+    out.append(buf + skip, len - skip);
+}
+
+static void multipart_content(multipart_stream_t *mp, const char *buf, size_t len, std::string &out) {
+    if (!mp->file) {
+        multipart_emit(mp, buf, len, out);
+        return;
+    }
+    mp->fileBytes += len;
+    if (mp->hash)
+        apr_sha1_update_binary(&mp->sha1, (const unsigned char *) buf, (unsigned int) len);
+}
+
+static void multipart_file_end(request_rec *r, multipart_stream_t *mp) {
+    mp->files++;
+    if (mp->hash) {
+        static const char hexdigits[] = "0123456789abcdef";
+        unsigned char digest[APR_SHA1_DIGESTSIZE];
+        char hex[2 * APR_SHA1_DIGESTSIZE + 1];
+        apr_sha1_final(digest, &mp->sha1);
+        for (int i = 0; i < APR_SHA1_DIGESTSIZE; i++) {
+            hex[2 * i] = hexdigits[digest[i] >> 4];
+            hex[2 * i + 1] = hexdigits[digest[i] & 0xf];
+        }
+        hex[2 * APR_SHA1_DIGESTSIZE] = '\0';
+        apr_table_set(r->subprocess_env, apr_psprintf(r->pool, "defender_upload_sha1_%u", mp->files), hex);
+        ap_log_rerror(APLOG_MARK, APLOG_INFO, 0, r, "Upload #%u: %" APR_OFF_T_FMT " bytes, sha1 %s", mp->files,
+                      mp->fileBytes, hex);
+    }
+    mp->file = false;
+    mp->fileBytes = 0;
+}
+
+/* Index past the empty line ending the part headers which start at pos, npos until it is received */
+static size_t multipart_headers_end(const std::string &pending, size_t pos) {
+    size_t lf = pending.find("\n\n", pos), crlf = pending.find("\n\r\n", pos);
+    if (lf != std::string::npos && (crlf == std::string::npos || lf < crlf))
+        return lf + 2;
+    return crlf == std::string::npos ? crlf : crlf + 3;
+}
+
+static void multipart_feed(request_rec *r, multipart_stream_t *mp, const char *buf, size_t len, std::string &out) {
+    mp->pending.append(buf, len);
+    const std::string &pending = mp->pending;
+    size_t pos = 0;
+    for (;;) {
+        if (mp->state == MULTIPART_CONTENT) {
+            size_t found = pending.find(mp->delimiter, pos);
+            // Without a boundary, hold back what could be its beginning and the CR before it
+            size_t end = found;
+            if (found == std::string::npos)
+                end = std::max(pos, pending.size() >= mp->delimiter.size() ?
+                                    pending.size() - mp->delimiter.size() : 0);
+            else if (found > pos && pending[found - 1] == '\r')
+                end = found - 1;
+            multipart_content(mp, pending.data() + pos, end - pos, out);
+            pos = end;
+            if (found == std::string::npos)
+                break;
+            if (mp->file)
+                multipart_file_end(r, mp);
+            // The pretended LF before the first boundary goes with the skipped byte
+            mp->bareLf = found == pos && mp->skip == 0;
+            if (mp->bareLf)
+                out.push_back('\r');
+            multipart_emit(mp, pending.data() + pos, found + mp->delimiter.size() - pos, out);
+            pos = found + mp->delimiter.size();
+            mp->state = MULTIPART_HEADERS;
+        } else if (mp->state == MULTIPART_HEADERS) {
+            if (pending.size() - pos >= 2 && pending.compare(pos, 2, "--") == 0) {
+                mp->state = MULTIPART_EPILOGUE;
+                continue;
+            }
+            size_t found = multipart_headers_end(pending, pos);
+            if (found == std::string::npos) {
+                // Not what a browser sends, stop looking for files
+                if (pending.size() - pos > MULTIPART_HEADERS_MAX) {
+                    mp->state = MULTIPART_OFF;
+                    continue;
+                }
+                break;
+            }
+            std::string headers;
+            for (size_t i = pos; i < found; i++) {
+                if (pending[i] == '\n' && (i == pos || pending[i - 1] != '\r')) {
+                    headers.push_back('\r');
+                    mp->bareLf = true;
+                }
+                headers.push_back(pending[i]);
+            }
+            out.append(headers);
+            pos = found;
+            std::transform(headers.begin(), headers.end(), headers.begin(), ::tolower);
+            mp->file = !mp->bareLf && multipart_is_file(headers);
+            if (mp->file && mp->hash)
+                apr_sha1_init(&mp->sha1);
+            mp->state = MULTIPART_CONTENT;
+        } else {
+            multipart_emit(mp, pending.data() + pos, pending.size() - pos, out);
+            pos = pending.size();
+            break;
+        }
+    }
+    mp->pending.erase(0, pos);
+}
+
+/* Flushes what was held back once the whole body has been read */
+static void multipart_finish(request_rec *r, multipart_stream_t *mp, std::string &out) {
+    if (mp->state == MULTIPART_CONTENT)
+        multipart_content(mp, mp->pending.data(), mp->pending.size(), out);
+    else
+        multipart_emit(mp, mp->pending.data(), mp->pending.size(), out);
+    if (mp->file)
+        multipart_file_end(r, mp);
+    mp->pending.clear();
+}
+
+/*
+ * Buckets kept across ap_get_brigade() calls must own their data, mod_ssl
+ * hands transient buckets pointing into a buffer it reuses for every read.
+ */
+static apr_status_t setaside_brigade(apr_bucket_brigade *bb, apr_pool_t *p) {
+    for (apr_bucket *bucket = APR_BRIGADE_FIRST(bb);
+         bucket != APR_BRIGADE_SENTINEL(bb); bucket = APR_BUCKET_NEXT(bucket)) {
+        apr_status_t rv = apr_bucket_setaside(bucket, p);
+        if (rv != APR_SUCCESS && rv != APR_ENOTIMPL)
+            return rv;
+    }
+    return APR_SUCCESS;
+}
+
+/*
+ * Upload spooling.
+ * File content left out of the scan does not count against RequestBodyLimit,
+ * yet the handler still needs it. Once the buckets set aside in memory would
+ * go over the limit, the rest of a multipart body is written to a temporary
+ * file, deleted along with the request pool, and handed back as file buckets.
+ */
+#define SPOOL_BUCKET_MAX (1 << 30)
+
+typedef struct {
+    apr_file_t *file;
+    apr_off_t size;
+    apr_bucket *last; // file bucket extended by the next bytes when they follow it
+} body_spool_t;
+
+/*
+ * Writes the bytes of a bucket of bb to the spool and puts a file bucket in its
+ * place, or extends the previous one, be it in bb or at the end of body.
+ */
+static apr_status_t spool_bucket(request_rec *r, body_spool_t *spool, apr_bucket_brigade *body,
+                                 apr_bucket_brigade *bb, apr_bucket **bucket, const char *buf, apr_size_t nbytes) {
+    apr_status_t rv;
+    if (spool->file == NULL) {
+        const char *dir;
+        rv = apr_temp_dir_get(&dir, r->pool);
+        if (rv != APR_SUCCESS)
+            return rv;
+        rv = apr_file_mktemp(&spool->file, apr_pstrcat(r->pool, dir, "/defender-XXXXXX", NULL), 0, r->pool);
+        if (rv != APR_SUCCESS)
+            return rv;
+    }
+    rv = apr_file_write_full(spool->file, buf, nbytes, NULL);
+    if (rv != APR_SUCCESS)
+        return rv;
+
+    apr_bucket *prev = APR_BUCKET_PREV(*bucket);
+    if (prev == APR_BRIGADE_SENTINEL(bb) && !APR_BRIGADE_EMPTY(body))
+        prev = APR_BRIGADE_LAST(body);
+    if (spool->last != NULL && prev == spool->last && spool->last->length + nbytes <= SPOOL_BUCKET_MAX) {
+        spool->last->length += nbytes;
+    } else {
+        spool->last = apr_bucket_file_create(spool->file, spool->size, nbytes, r->pool, r->connection->bucket_alloc);
+        APR_BUCKET_INSERT_BEFORE(*bucket, spool->last);
+    }
+    spool->size += nbytes;
+    apr_bucket_delete(*bucket);
+    *bucket = spool->last;
+    return APR_SUCCESS;
+}
+
+/*
+ * Reads then scans the body of a POST / PUT request.
+ */
+static int scan_body(request_rec *r, dir_config_t *dcfg) {
     int ret;
-    dir_config_t *dcfg = (dir_config_t *) ap_get_module_config(r->per_dir_config, &defender_module);
-    // Stop if Defender not enabled
-    if (!dcfg->defender)
-        return DECLINED;
+    bool eos = false;
+    uint64_t readStart;
+    apr_off_t received = 0, held = 0;
+    body_spool_t spool = body_spool_t();
+    multipart_stream_t multipart = multipart_stream_t();
+    multipart.state = MULTIPART_OFF;
+    bool multipartBody = false;
 
     // Stop if this is not the main request
     if (r->main != NULL || r->prev != NULL)
@@ -257,57 +2312,58 @@ static int fixups(request_rec *r) {
     if (r->method_number != M_POST && r->method_number != M_PUT)
         return DECLINED;
 
+    // No scanner when header_parser let the request through without one
     defender_config_t *defc = (defender_config_t *) ap_get_module_config(r->request_config, &defender_module);
+    if (defc == NULL)
+        return DECLINED;
     RuntimeScanner *scanner = defc->vpRuntimeScanner;
 
     if (scanner->contentLengthProvided && scanner->contentLength == 0)
-        return scanner->processBody();
+        return process_body(r, defc->parser, scanner);
 
     if (scanner->contentType == CONTENT_TYPE_UNSUPPORTED)
-        return scanner->processBody();
+        return process_body(r, defc->parser, scanner);
 
     if (scanner->bodyLimitExceeded)
-        return scanner->processBody();
+        return process_body(r, defc->parser, scanner);
 
-    if (!scanner->contentLengthProvided)
+    if (!scanner->contentLengthProvided && !scanner->transferEncodingProvided)
         return HTTP_NOT_IMPLEMENTED;
 
-    if (scanner->transferEncodingProvided /*&& scanner->transferEncoding == TRANSFER_ENCODING_UNSUPPORTED*/)
-        return HTTP_NOT_IMPLEMENTED;
+    // File parts of an upload are streamed past the scanner copy
+    if (dcfg->upload_skip_content)
+        multipartBody = multipart_init(r, &multipart, dcfg->upload_hash);
 
-    // Retrieve the body
-    // Pre-allocate necessary bytes
-    scanner->body.reserve(scanner->contentLength);
+    // Pre-allocate necessary bytes, chunked bodies grow as they arrive
+    if (scanner->contentLengthProvided && multipart.state == MULTIPART_OFF)
+        scanner->body.reserve(std::min<unsigned long>(scanner->contentLength, dcfg->requestBodyLimit));
 
-    // Wait for the body to be fully received 
+    // Read the body once, bucket by bucket as it arrives, and set the buckets aside for the handler
+    readStart = stats_clock();
+    apr_bucket_brigade *body = apr_brigade_create(r->pool, r->connection->bucket_alloc);
     apr_bucket_brigade *bb = apr_brigade_create(r->pool, r->connection->bucket_alloc);
-    unsigned int prev_nr_buckets = 0;
-    if (bb == NULL)
+    if (body == NULL || bb == NULL)
         goto read_error_out;
     do {
-        int rc = ap_get_brigade(r->input_filters, bb, AP_MODE_SPECULATIVE, APR_BLOCK_READ, LONG_MAX);
+        int rc = ap_get_brigade(r->input_filters, bb, AP_MODE_READBYTES, APR_BLOCK_READ, HUGE_STRING_LEN);
         if (rc != APR_SUCCESS) {
             ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "Error reading body: %s", get_apr_error(r->pool, rc));
             goto read_error_out;
         }
 
-        unsigned int nr_buckets = 0;
         // Iterate over buckets
         for (apr_bucket *bucket = APR_BRIGADE_FIRST(bb);
              bucket != APR_BRIGADE_SENTINEL(bb); bucket = APR_BUCKET_NEXT(bucket)) {
             // Stop if we reach the EOS bucket
-            if (APR_BUCKET_IS_EOS(bucket))
+            if (APR_BUCKET_IS_EOS(bucket)) {
+                eos = true;
                 break;
+            }
 
             // Ignore non data buckets
             if (APR_BUCKET_IS_METADATA(bucket) || APR_BUCKET_IS_FLUSH(bucket))
                 continue;
 
-            nr_buckets++;
-            // Skip already copied buckets
-            if (nr_buckets <= prev_nr_buckets)
-                continue;
-
             const char *buf;
             apr_size_t nbytes;
             int rv = apr_bucket_read(bucket, &buf, &nbytes, APR_BLOCK_READ);
@@ -317,60 +2373,126 @@ static int fixups(request_rec *r) {
                 goto read_error_out;
             }
 
-//            cerr << "bucket #" << nr_buckets - 1 << " received, nbytes: " << nbytes << ", total len: "
-//                 << scanner->body.length() + nbytes << endl;
-
             // More bytes in the BODY than specified in the content-length
-            if (scanner->body.length() + nbytes > scanner->contentLength) {
+            if (scanner->contentLengthProvided && received + nbytes > scanner->contentLength) {
                 ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "Too much POST data: received body of %lu bytes but "
-                        "got content-length: %lu", scanner->body.length() + nbytes, scanner->contentLength);
+                        "got content-length: %lu", (unsigned long) (received + nbytes), scanner->contentLength);
                 goto read_error_out;
             }
 
-            // More bytes in the BODY than specified by the allowed body limit
-            if (scanner->body.length() + nbytes > dcfg->requestBodyLimit) {
+            // More bytes in the BODY than specified by the allowed body limit,
+            // the remaining buckets are left to the handler unscanned
+            if (scanner->body.length() + multipart.pending.size() + nbytes > dcfg->requestBodyLimit) {
                 scanner->bodyLimitExceeded = true;
                 ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "Body limit exceeded (%lu)", dcfg->requestBodyLimit);
                 break;
             }
 
-            scanner->body.append(buf, nbytes);
+            received += nbytes;
+            if (multipart.state != MULTIPART_OFF)
+                multipart_feed(r, &multipart, buf, nbytes, scanner->body);
+            else
+                scanner->body.append(buf, nbytes);
+
+            // Skipped file content is only free once it is not held in memory anymore
+            if (multipartBody && (spool.file != NULL || held + nbytes > dcfg->requestBodyLimit)) {
+                rv = spool_bucket(r, &spool, body, bb, &bucket, buf, nbytes);
+                if (rv != APR_SUCCESS) {
+                    ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "Failed spooling upload: %s",
+                                  get_apr_error(r->pool, rv));
+                    goto read_error_out;
+                }
+            } else {
+                held += nbytes;
+            }
         }
-        prev_nr_buckets = nr_buckets;
 
-        if (scanner->body.length() == scanner->contentLength)
-            break;
+        // Keep what has been read so that the handler still gets it
+        rc = setaside_brigade(bb, r->pool);
+        if (rc != APR_SUCCESS) {
+            ap_log_rerror(APLOG_MARK, APLOG_NOTICE, 0, r, "Failed setting aside input: %s", get_apr_error(r->pool, rc));
+            goto read_error_out;
+        }
+        APR_BRIGADE_CONCAT(body, bb);
+    } while (!eos && !scanner->bodyLimitExceeded);
+    if (multipartBody)
+        multipart_finish(r, &multipart, scanner->body);
+    stats_phase(PHASE_BODY_READ, readStart);
 
-        apr_brigade_cleanup(bb);
-        apr_sleep(1000);
-    } while (true);
+    // Replay the body to whoever reads it next
+    ap_add_input_filter(defender_in_filter_name, body, r, r->connection);
 
-//    cerr << "[pid " << getpid() << "] read " << scanner->body.length() << " bytes, ";
-//    cerr << "content-length: " << scanner->contentLength << endl;
-//    cerr << "body: " << scanner->body << endl;
+    // A chunked body is only known once fully received
+    if (!scanner->contentLengthProvided)
+        scanner->contentLength = scanner->body.length();
 
     // Run scanner
-    ret = scanner->processBody();
+    ret = process_body(r, defc->parser, scanner);
+
+    // The scanned copy is not needed anymore while the handler runs
+    std::string().swap(scanner->body);
 
     if (dcfg->useenv)
         ret = pass_in_env(r, scanner);
 
-//    cerr << "[pid " << getpid() << "] body (" << scanner->body.length() << ") scanned" << endl;
-
     return ret;
 
     read_error_out:
-    if (dcfg->useenv) return DECLINED;
+    // Let the handler through only if it gets back what was already taken out of the input chain
+    if (dcfg->useenv && body != NULL && bb != NULL && setaside_brigade(bb, r->pool) == APR_SUCCESS) {
+        APR_BRIGADE_CONCAT(body, bb);
+        ap_add_input_filter(defender_in_filter_name, body, r, r->connection);
+        return DECLINED;
+    }
     return HTTP_INTERNAL_SERVER_ERROR;
 }
 
+/*
+ * This routine is called to perform any module-specific fixing of header
+ * fields, et cetera.  It is invoked just before any content-handler.
+ *
+ * This is a RUN_ALL HOOK.
+ */
+static int fixups(request_rec *r) {
+    dir_config_t *dcfg = (dir_config_t *) ap_get_module_config(r->per_dir_config, &defender_module);
+    // Stop if Defender not enabled
+    if (!dcfg->defender)
+        return DECLINED;
+
+    // Nothing to do for a request header_parser let through without a scanner
+    if (ap_get_module_config(r->request_config, &defender_module) == NULL)
+        return DECLINED;
+
+    uint64_t start = stats_clock();
+    log_loc = dcfg;
+    int ret = scan_body(r, dcfg);
+
+    // A block on the body counts against the client too, once per request
+    defender_config_t *defc = (defender_config_t *) ap_get_module_config(r->request_config, &defender_module);
+    if (defc != NULL && !defc->offenderRecorded && dcfg->offender_tracking && offender_table != NULL &&
+        !dcfg->learning && !offender_allowed(r)) {
+        RuntimeScanner *scanner = defc->vpRuntimeScanner;
+        if ((scanner->block && !scanner->learning) || scanner->drop) {
+            offender_record(r);
+            defc->offenderRecorded = true;
+        }
+    }
+
+    stats_request(dcfg, start, ret, false);
+    return ret;
+}
+
 /* Apache callback to register our hooks.
  */
 static void defender_register_hooks(apr_pool_t *) {
+    ap_hook_pre_config(pre_config, NULL, NULL, APR_HOOK_MIDDLE);
     ap_hook_post_config(post_config, NULL, NULL, APR_HOOK_REALLY_FIRST);
+    ap_hook_child_init(child_init, NULL, NULL, APR_HOOK_MIDDLE);
     static const char *const aszSucc[] = {"mod_security2.c", NULL};
     ap_hook_header_parser(header_parser, NULL, aszSucc, APR_HOOK_REALLY_FIRST - 20);
     ap_hook_fixups(fixups, NULL, aszSucc, APR_HOOK_REALLY_FIRST - 20);
+    ap_hook_handler(status_handler, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_register_input_filter(defender_in_filter_name, defender_in_filter, NULL, AP_FTYPE_CONTENT_SET);
 }
 
 /**
@@ -480,6 +2602,238 @@ static const char *set_useenv_flag(cmd_parms *, void *cfg, int flag) {
     return NULL;
 }
 
+static const char *set_matchlog_buffer(cmd_parms *cmd, void *, const char *arg) {
+    char *end;
+    unsigned long records = strtoul(arg, &end, 10);
+    if (*end != '\0' || records > 1048576)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid value for MatchLogBuffer: %s", arg);
+    log_cfg.buffer = (unsigned int) records;
+    return NULL;
+}
+
+static const char *set_matchlog_flush(cmd_parms *cmd, void *, const char *size, const char *interval) {
+    char *end;
+    unsigned long records = strtoul(size, &end, 10);
+    if (*end != '\0' || records == 0)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid record count for MatchLogFlush: %s", size);
+    log_cfg.flushSize = (unsigned int) records;
+    if (interval != NULL) {
+        unsigned long msec = strtoul(interval, &end, 10);
+        if (*end != '\0' || msec == 0)
+            return apr_psprintf(cmd->pool, "mod_defender: Invalid interval for MatchLogFlush: %s", interval);
+        log_cfg.flushInterval = apr_time_from_msec(msec);
+    }
+    return NULL;
+}
+
+static const char *set_matchlog_overflow(cmd_parms *cmd, void *, const char *arg) {
+    if (!strcasecmp(arg, "Drop"))
+        log_cfg.overflowSync = false;
+    else if (!strcasecmp(arg, "Sync"))
+        log_cfg.overflowSync = true;
+    else
+        return apr_psprintf(cmd->pool, "mod_defender: MatchLogOverflow must be Drop or Sync: %s", arg);
+    return NULL;
+}
+
+static const char *set_upload_skip_content_flag(cmd_parms *, void *cfg, int flag) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    dcfg->upload_skip_content = (bool) flag;
+    return NULL;
+}
+
+static const char *set_upload_hash_flag(cmd_parms *, void *cfg, int flag) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    dcfg->upload_hash = (bool) flag;
+    return NULL;
+}
+
+static const char *set_rules_file(cmd_parms *cmd, void *cfg, const char *arg) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    dcfg->rules_file = ap_server_root_relative(cmd->pool, arg);
+    if (dcfg->rules_file == NULL)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid RulesFile path: %s", arg);
+    std::vector<std::pair<std::string, std::string>> checkRules;
+    std::vector<std::string> basicRules;
+    apr_time_t mtime;
+    std::string err;
+    if (!load_rules_file(dcfg->rules_file, checkRules, basicRules, mtime, err) || !err.empty())
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid RulesFile: %s", err.c_str());
+    return NULL;
+}
+
+static const char *set_rules_reload_interval(cmd_parms *cmd, void *, const char *arg) {
+    char *end;
+    long seconds = strtol(arg, &end, 10);
+    if (*end != '\0' || seconds < 0)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid value for RulesReloadInterval: %s", arg);
+    rules_reload_interval = apr_time_from_sec(seconds);
+    return NULL;
+}
+
+static const char *set_verdict_cache_flag(cmd_parms *, void *cfg, int flag) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    dcfg->verdict_cache = (bool) flag;
+    return NULL;
+}
+
+static const char *set_verdict_cache_size(cmd_parms *cmd, void *, const char *arg) {
+    char *end;
+    unsigned long entries = strtoul(arg, &end, 10);
+    if (*end != '\0' || entries > 16777216)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid value for VerdictCacheSize: %s", arg);
+    verdict_cache_size = (apr_size_t) entries;
+    return NULL;
+}
+
+static const char *set_verdict_cache_ttl(cmd_parms *cmd, void *, const char *arg) {
+    char *end;
+    long seconds = strtol(arg, &end, 10);
+    if (*end != '\0' || seconds <= 0)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid value for VerdictCacheTTL: %s", arg);
+    verdict_cache_ttl = apr_time_from_sec(seconds);
+    return NULL;
+}
+
+static const char *set_offender_tracking_flag(cmd_parms *, void *cfg, int flag) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    dcfg->offender_tracking = (bool) flag;
+    return NULL;
+}
+
+static const char *set_offender_table_size(cmd_parms *cmd, void *, const char *arg) {
+    char *end;
+    unsigned long entries = strtoul(arg, &end, 10);
+    if (*end != '\0' || entries > 16777216)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid value for OffenderTableSize: %s", arg);
+    offender_cfg.size = (apr_size_t) entries;
+    return NULL;
+}
+
+static const char *set_offender_threshold(cmd_parms *cmd, void *, const char *arg) {
+    char *end;
+    double blocks = strtod(arg, &end);
+    if (*end != '\0' || !(blocks > 0))
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid value for OffenderThreshold: %s", arg);
+    offender_cfg.threshold = blocks;
+    return NULL;
+}
+
+static const char *set_offender_half_life(cmd_parms *cmd, void *, const char *arg) {
+    char *end;
+    long seconds = strtol(arg, &end, 10);
+    if (*end != '\0' || seconds <= 0)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid value for OffenderHalfLife: %s", arg);
+    offender_cfg.halfLife = apr_time_from_sec(seconds);
+    return NULL;
+}
+
+static const char *set_offender_action(cmd_parms *cmd, void *, const char *action, const char *delay) {
+    if (!strcasecmp(action, "Block") && delay == NULL) {
+        offender_cfg.tarpit = 0;
+        return NULL;
+    }
+    if (!strcasecmp(action, "Tarpit") && delay != NULL) {
+        char *end;
+        unsigned long msec = strtoul(delay, &end, 10);
+        if (*end != '\0' || msec == 0 || msec > OFFENDER_TARPIT_MAX)
+            return apr_psprintf(cmd->pool, "mod_defender: Invalid delay for OffenderAction Tarpit: %s", delay);
+        offender_cfg.tarpit = apr_time_from_msec(msec);
+        return NULL;
+    }
+    return "mod_defender: OffenderAction must be Block or Tarpit <milliseconds>";
+}
+
+static const char *set_offender_allow(cmd_parms *cmd, void *, const char *arg) {
+    char *ip = apr_pstrdup(cmd->temp_pool, arg);
+    char *mask = strchr(ip, '/');
+    if (mask != NULL)
+        *mask++ = '\0';
+    apr_ipsubnet_t *subnet;
+    if (apr_ipsubnet_create(&subnet, ip, mask, cmd->pool) != APR_SUCCESS)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid address for OffenderAllow: %s", arg);
+    if (offender_cfg.allow == NULL)
+        offender_cfg.allow = apr_array_make(cmd->pool, 4, sizeof(apr_ipsubnet_t *));
+    APR_ARRAY_PUSH(offender_cfg.allow, apr_ipsubnet_t *) = subnet;
+    return NULL;
+}
+
+static const char *set_learning_aggregate_flag(cmd_parms *, void *cfg, int flag) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    dcfg->learning_aggregate = (bool) flag;
+    return NULL;
+}
+
+static const char *set_learning_aggregate_flush(cmd_parms *cmd, void *, const char *arg) {
+    char *end;
+    long seconds = strtol(arg, &end, 10);
+    if (*end != '\0' || seconds <= 0)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid value for LearningAggregateFlush: %s", arg);
+    learning_agg_cfg.interval = apr_time_from_sec(seconds);
+    return NULL;
+}
+
+static const char *set_learning_aggregate_samples(cmd_parms *cmd, void *, const char *arg) {
+    char *end;
+    unsigned long samples = strtoul(arg, &end, 10);
+    if (*end != '\0' || samples > 100)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid value for LearningAggregateSamples: %s", arg);
+    learning_agg_cfg.samples = (unsigned int) samples;
+    return NULL;
+}
+
+static const char *set_body_scan_threads(cmd_parms *cmd, void *, const char *threads, const char *minBody) {
+    char *end;
+    unsigned long count = strtoul(threads, &end, 10);
+    if (*end != '\0' || count > 64)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid thread count for BodyScanThreads: %s", threads);
+    body_scan_cfg.threads = (unsigned int) count;
+    if (minBody != NULL) {
+        unsigned long bytes = strtoul(minBody, &end, 10);
+        if (*end != '\0' || bytes < 2 * BODY_SEGMENT_MIN)
+            return apr_psprintf(cmd->pool, "mod_defender: Invalid body size for BodyScanThreads: %s", minBody);
+        body_scan_cfg.minBody = (apr_size_t) bytes;
+    }
+    return NULL;
+}
+
+static const char *set_bypass_prefix(cmd_parms *cmd, void *cfg, const char *arg) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    if (arg[0] != '/')
+        return apr_psprintf(cmd->pool, "mod_defender: BypassPrefix must start with a /: %s", arg);
+    dcfg->bypassPrefixes.push_back(arg);
+    return NULL;
+}
+
+static const char *set_bypass_extension(cmd_parms *cmd, void *cfg, const char *arg) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    std::string extension = arg[0] == '.' ? arg : std::string(".") + arg;
+    if (extension.size() < 2 || extension.find('/') != std::string::npos)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid BypassExtension: %s", arg);
+    std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+    dcfg->bypassExtensions.push_back(extension);
+    return NULL;
+}
+
+static const char *set_bypass_method(cmd_parms *cmd, void *cfg, const char *arg) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    int method = ap_method_number_of(arg);
+    if (method == M_INVALID || method >= 64)
+        return apr_psprintf(cmd->pool, "mod_defender: Invalid BypassMethod: %s", arg);
+    dcfg->bypass_methods |= AP_METHOD_BIT << method;
+    return NULL;
+}
+
+static const char *set_learning_sample_rate(cmd_parms *cmd, void *cfg, const char *arg) {
+    dir_config_t *dcfg = (dir_config_t *) cfg;
+    char *end;
+    double percent = strtod(arg, &end);
+    if (*end != '\0' || !(percent > 0 && percent <= 100))
+        return apr_psprintf(cmd->pool, "mod_defender: LearningSampleRate must be a percentage above 0: %s", arg);
+    dcfg->learning_sample = percent < 100 ? percent / 100 : 0;
+    return NULL;
+}
+
 static const char *set_mainrules(cmd_parms *, void *, const char *line) {
     tmpMainRules.push_back(std::string(line));
     return NULL;
@@ -513,6 +2867,30 @@ static const command_rec directives[] = {
         {"LibinjectionSQL",  (cmd_func) set_libinjection_sql_flag, NULL, ACCESS_CONF, FLAG,     "Libinjection SQL toggle"},
         {"LibinjectionXSS",  (cmd_func) set_libinjection_xss_flag, NULL, ACCESS_CONF, FLAG,     "Libinjection XSS toggle"},
         {"UseEnv",           (cmd_func) set_useenv_flag,           NULL, ACCESS_CONF, FLAG,     "UseEnv toggle"},
+        {"UploadSkipContent", (cmd_func) set_upload_skip_content_flag, NULL, ACCESS_CONF, FLAG, "Leave the content of uploaded files out of the scan"},
+        {"UploadHash",       (cmd_func) set_upload_hash_flag,      NULL, ACCESS_CONF, FLAG,     "SHA1 of uploaded files in defender_upload_sha1_<n>"},
+        {"RulesFile",        (cmd_func) set_rules_file,            NULL, ACCESS_CONF, TAKE1,    "CheckRule / BasicRule file reloaded when it changes"},
+        {"RulesReloadInterval", (cmd_func) set_rules_reload_interval, NULL, RSRC_CONF, TAKE1,  "Seconds between two checks of the RulesFiles, 0 to disable reloads"},
+        {"MatchLogBuffer",   (cmd_func) set_matchlog_buffer,       NULL, RSRC_CONF,   TAKE1,    "Records buffered per child before being written asynchronously, 0 to write synchronously"},
+        {"MatchLogFlush",    (cmd_func) set_matchlog_flush,        NULL, RSRC_CONF,   TAKE12,   "Records then milliseconds after which the match log buffer is flushed"},
+        {"MatchLogOverflow", (cmd_func) set_matchlog_overflow,     NULL, RSRC_CONF,   TAKE1,    "Drop or Sync records when the match log buffer is full"},
+        {"VerdictCache",     (cmd_func) set_verdict_cache_flag,    NULL, ACCESS_CONF, FLAG,     "Skip the scan of GET requests already found clean"},
+        {"VerdictCacheSize", (cmd_func) set_verdict_cache_size,    NULL, RSRC_CONF,   TAKE1,    "Clean GET requests remembered by the verdict cache"},
+        {"VerdictCacheTTL",  (cmd_func) set_verdict_cache_ttl,     NULL, RSRC_CONF,   TAKE1,    "Seconds a clean verdict is kept"},
+        {"OffenderTracking", (cmd_func) set_offender_tracking_flag, NULL, ACCESS_CONF, FLAG,    "Reject the clients blocked too often lately"},
+        {"OffenderTableSize", (cmd_func) set_offender_table_size,  NULL, RSRC_CONF,   TAKE1,    "Client IPs tracked by the offender table"},
+        {"OffenderThreshold", (cmd_func) set_offender_threshold,   NULL, RSRC_CONF,   TAKE1,    "Decayed count of blocks from which a client is rejected"},
+        {"OffenderHalfLife", (cmd_func) set_offender_half_life,    NULL, RSRC_CONF,   TAKE1,    "Seconds after which the blocks of a client count for half"},
+        {"OffenderAction",   (cmd_func) set_offender_action,       NULL, RSRC_CONF,   TAKE12,   "Block, or Tarpit <milliseconds> before rejecting an offender"},
+        {"OffenderAllow",    (cmd_func) set_offender_allow,        NULL, RSRC_CONF,   ITERATE,  "IPs or subnets never tracked as offenders"},
+        {"LearningAggregate", (cmd_func) set_learning_aggregate_flag, NULL, ACCESS_CONF, FLAG,  "Count learning matches per child and log summaries instead of every match"},
+        {"LearningAggregateFlush", (cmd_func) set_learning_aggregate_flush, NULL, RSRC_CONF, TAKE1, "Seconds between two writes of the learning summaries"},
+        {"LearningAggregateSamples", (cmd_func) set_learning_aggregate_samples, NULL, RSRC_CONF, TAKE1, "Sample values kept per learning summary"},
+        {"BodyScanThreads",  (cmd_func) set_body_scan_threads,     NULL, RSRC_CONF,   TAKE12,   "Threads per child scanning large urlencoded bodies in parallel, then body size from which they are used"},
+        {"BypassPrefix",     (cmd_func) set_bypass_prefix,         NULL, ACCESS_CONF, ITERATE,  "URI prefixes let through without a scan"},
+        {"BypassExtension",  (cmd_func) set_bypass_extension,      NULL, ACCESS_CONF, ITERATE,  "File extensions let through without a scan"},
+        {"BypassMethod",     (cmd_func) set_bypass_method,         NULL, ACCESS_CONF, ITERATE,  "Methods let through without a scan"},
+        {"LearningSampleRate", (cmd_func) set_learning_sample_rate, NULL, ACCESS_CONF, TAKE1,   "Percentage of the requests of a learning location scanned"},
         {NULL}
 };
 
@@ -18,11 +18,17 @@ test_count=$((test_count + 1))
 echo -e "sent 2MB @ 350kb/s                            " "$req" "$status_code  $test_msg"
 
 status_code=$(printf %1000s | tr " " "a" | curl $HOST --data-binary @- -H "Transfer-Encoding: chunked" $curl_ret)
-test_msg=`check_status_code $status_code 501`
+test_msg=`check_block $status_code 0`
 test_passed=$((test_passed + $?))
 test_count=$((test_count + 1))
 echo -e "sent 1kB with transfer-encoding: chunked      " "$req" "$status_code  $test_msg"
 
+status_code=$(printf "x=%1000s+select+from" | tr " " "a" | curl $HOST --data-binary @- -H "Transfer-Encoding: chunked" $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "x=<1000*a>+select+from chunked                " "$req" "$status_code  $test_msg"
+
 status_code=$(curl $HOST -X POST -H 'Content-Length:' $curl_ret)
 test_msg=`check_block $status_code 1`
 test_passed=$((test_passed + $?))
@@ -54,5 +60,172 @@ test_passed=$((test_passed + $?))
 test_count=$((test_count + 1))
 echo -e "<200*a>+select+from=x                         " "$req" "$status_code  $test_msg"
 
+status_code=$(for i in $(seq 20000); do printf "a$i=%20s&" | tr " " "a"; done | curl $HOST --data-binary @- $curl_ret)
+test_msg=`check_block $status_code 0`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "20000 clean args (parallel scan)              " "$req" "$status_code  $test_msg"
+
+status_code=$( (for i in $(seq 20000); do printf "a$i=%20s&" | tr " " "a"; done; printf "x=select+from") | curl $HOST --data-binary @- $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "20000 clean args then select+from             " "$req" "$status_code  $test_msg"
+
+status_code=$(printf "hello" | curl $HOST -F "user_filename=select from" -F "upload=@-;filename=a.txt" $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "multipart field named *filename* + file       " "$req" "$status_code  $test_msg"
+
+status_code=$(printf -- '--B\r\nContent-Disposition: form-data; name="f"; filename="a.txt"\r\n\r\nhello\n--B\n%s\n\n%s\r\n--B--\r\n' \
+	'Content-Disposition: form-data; name="q"' 'select from' |
+	curl $HOST -H "Content-Type: multipart/form-data; boundary=B" --data-binary @- $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "multipart field after a LF-only boundary      " "$req" "$status_code  $test_msg"
+
+status_code=$(printf -- '--B\r\n%s\r\n\r\nselect from\r\n--B--\r\n' \
+	"Content-Disposition: form-data; name=\"q\"; filename*=UTF-8''a.txt" |
+	curl $HOST -H "Content-Type: multipart/form-data; boundary=B" --data-binary @- $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "multipart field with filename* only           " "$req" "$status_code  $test_msg"
+
+status_code=$(printf -- '--B\r\n%s\r\n%s\r\n\r\nselect from\r\n--B--\r\n' \
+	'Content-Disposition: form-data; name="q"' 'Content-Disposition: form-data; name="f"; filename="a.txt"' |
+	curl $HOST -H "Content-Type: multipart/form-data; boundary=B" --data-binary @- $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "multipart field with a 2nd Content-Disposition" "$req" "$status_code  $test_msg"
+
+status_code=$(printf "select from" | curl $HOST -F "q=hello" -F "upload=@-;filename=a.txt" $curl_ret)
+test_msg=`check_block $status_code 0`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "multipart file content skipped                " "$req" "$status_code  $test_msg"
+
+verdict_cache_hits() {
+	curl -s "$HOST/defender-status?json" | sed -n 's/.*"verdict_cache":{"hits":\([0-9]*\).*/\1/p'
+}
+
+hits_before=$(verdict_cache_hits)
+for i in 1 2; do
+	status_code=$(curl "$HOST/?x=repeated" $curl_ret)
+	test_msg=`check_block $status_code 0`
+	test_passed=$((test_passed + $?))
+	test_count=$((test_count + 1))
+	echo -e "same clean GET, try $i                         " "$req" "$status_code  $test_msg"
+done
+hits_after=$(verdict_cache_hits)
+if [ -n "$hits_before" ] && [ -n "$hits_after" ] && [ "$hits_after" -gt "$hits_before" ]; then
+	test_msg=`printf "$PASS_MESSAGE"`
+	test_passed=$((test_passed + 1))
+else
+	test_msg=`printf "$FAIL_MESSAGE"`
+fi
+test_count=$((test_count + 1))
+echo -e "same clean GET, verdict cache hit             " "$req" "$hits_before -> $hits_after  $test_msg"
+
+for i in 1 2; do
+	status_code=$(curl "$HOST/?x=select+from" $curl_ret)
+	test_msg=`check_block $status_code 1`
+	test_passed=$((test_passed + $?))
+	test_count=$((test_count + 1))
+	echo -e "same blocked GET, try $i                       " "$req" "$status_code  $test_msg"
+done
+
+status_code=$(curl "$HOST/style.css?x=select+from" $curl_ret)
+test_msg=`check_block $status_code 0`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "bypassed extension                            " "$req" "$status_code  $test_msg"
+
+status_code=$(curl "$HOST/style.css/../index.php?x=select+from" --path-as-is $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "bypassed extension in a .. segment            " "$req" "$status_code  $test_msg"
+
+status_code=$(curl "$HOST/index.html/x.css?x=select+from" $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "bypassed extension in PATH_INFO               " "$req" "$status_code  $test_msg"
+
+# CI buffers 16 records per child and asks for a flush every 64, only reached once clamped to the buffer
+MATCH_LOG=${MATCH_LOG:-/var/log/apache2/defender_match.log}
+ring_lines() {
+	(cat "$MATCH_LOG" 2>/dev/null || sudo cat "$MATCH_LOG") | grep -c "NAXSI_FMT: .*&uri=/ring-test&"
+}
+lines_before=$(ring_lines)
+for i in $(seq 1 40); do
+	curl "$HOST/ring-test?x=select+from" $curl_ret > /dev/null
+done
+sleep 3
+ring_written=$(($(ring_lines) - lines_before))
+if [ "$ring_written" == 40 ]; then
+	test_msg=`printf "$PASS_MESSAGE"`
+	test_passed=$((test_passed + 1))
+else
+	test_msg=`printf "$FAIL_MESSAGE"`
+fi
+test_count=$((test_count + 1))
+echo -e "40 blocks through a 16 records log buffer     " "$req" "$ring_written  $test_msg"
+
+LEARNING_LOG=${LEARNING_LOG:-/var/log/apache2/defender_learning.log}
+curl "$HOST/learning/?q=select+from&a=1" $curl_ret > /dev/null
+curl "$HOST/learning/?a=2&q=select+from" $curl_ret > /dev/null
+# LearningAggregateFlush then MatchLogFlush intervals
+sleep 5
+learning_log=$(cat "$LEARNING_LOG" 2>/dev/null || sudo cat "$LEARNING_LOG")
+agg_count=$(echo "$learning_log" | grep "NAXSI_AGG: loc=/learning/&.*&id=1000&zone=ARGS&var_name=q&" |
+	sed 's/.*&count=\([0-9]*\).*/\1/' | awk '{ s += $1 } END { print s + 0 }')
+if [ "$agg_count" == 2 ] && ! echo "$learning_log" | grep -E "NAXSI_(AGG|WL):" | grep -q "client:"; then
+	test_msg=`printf "$PASS_MESSAGE"`
+	test_passed=$((test_passed + 1))
+else
+	test_msg=`printf "$FAIL_MESSAGE"`
+fi
+test_count=$((test_count + 1))
+echo -e "learning matches aggregated per variable      " "$req" "$agg_count  $test_msg"
+
+# RulesReloadInterval is 5 seconds by default, directive names are case insensitive
+RULES_FILE=${RULES_FILE:-/etc/defender/reload.rules}
+rules=$(cat "$RULES_FILE")
+status_code=$(curl "$HOST/reload/?x=select+from" $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "RulesFile CheckRule                           " "$req" "$status_code  $test_msg"
+
+printf 'checkrule "$SQL >= 16" BLOCK\n' > "$RULES_FILE"
+sleep 7
+status_code=$(curl "$HOST/reload/?x=select+from" $curl_ret)
+test_msg=`check_block $status_code 0`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "RulesFile reloaded with a higher threshold    " "$req" "$status_code  $test_msg"
+printf '%s\n' "$rules" > "$RULES_FILE"
+
+# OffenderThreshold is 5 by default and the blocks decay as they are sent
+for i in 1 2 3 4 5 6; do
+	curl "$HOST/offender/?x=select+from" $curl_ret > /dev/null
+done
+status_code=$(curl "$HOST/offender/?x=clean" $curl_ret)
+test_msg=`check_block $status_code 1`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "clean GET from an offender                    " "$req" "$status_code  $test_msg"
+
+status_code=$(curl "$HOST/?x=offender" $curl_ret)
+test_msg=`check_block $status_code 0`
+test_passed=$((test_passed + $?))
+test_count=$((test_count + 1))
+echo -e "offender on a location without tracking       " "$req" "$status_code  $test_msg"
+
 echo $test_passed/$test_count "tests passed" \($(((test_passed * 100) / test_count))%\)
-exit $(($test_passed != $test_count))
\ No newline at end of file
+exit $(($test_passed != $test_count))